@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstring>
@@ -67,10 +68,10 @@ enum class SCSISenseKey
 ATAController::ATAController(System &sys) : sys(sys)
 {
     // 1F0-1F7 (primary, 170-177 for secondary)
-    sys.addIODevice(0x3F8, 0x1F0, 0, this);
+    sys.addIODevice(0x3F8, 0x1F0, this);
     // 3F6 (primary, 376 for secondary)
     // ATA-1 also specifies a read-only "drive address" at 3x7, which conflicts with the floppy controller
-    sys.addIODevice(0x3FF, 0x3F6, 0, this);
+    sys.addIODevice(0x3FF, 0x3F6, this);
 
     sectorsPerTrack[0] = sectorsPerTrack[1] = 0;
 }
@@ -122,48 +123,12 @@ uint16_t ATAController::read16(uint16_t addr)
         {
             if(pioReadLen)
             {
-                uint16_t ret = sectorBuf[bufOffset] | sectorBuf[bufOffset + 1] << 8;
+                uint16_t ret = readBuf[bufOffset] | readBuf[bufOffset + 1] << 8;
                 bufOffset += 2;
 
                 // check for end of transfer
                 if(bufOffset == pioReadLen)
-                {
-                    if(pioReadSectors > 1)
-                    {
-                        // next sector for multi-sector read
-                        pioReadSectors--;
-                        curLBA++;
-
-                        int dev = (deviceHead >> 4) & 1;
-
-                        status &= ~Status_DRQ;
-                        status |= Status_BSY;
-
-                        if(!io || !io->read(this, dev, sectorBuf, curLBA))
-                        {
-                            status &= ~Status_BSY;
-                            status |= Status_ERR;
-                        }
-
-                        bufOffset = 0;
-                    }
-                    else
-                    {
-                        if(pioReadLen != 512) // atapi
-                        {
-                            sectorCount = 1 << 0  // command
-                                        | 1 << 1; // to host
-                        }
-
-                        pioReadLen = 0;
-                        pioReadSectors = 0;
-
-                        // clear data request
-                        status &= ~Status_DRQ;
-
-                        flagIRQ();
-                    }
-                }
+                    finishPIORead();
 
                 return ret;
             }
@@ -177,6 +142,51 @@ uint16_t ATAController::read16(uint16_t addr)
     }
 }
 
+uint32_t ATAController::read32(uint16_t addr)
+{
+    // only the data port supports 32-bit accesses
+    if((addr & ~(1 << 7)) != 0x170)
+        return read16(addr) | read16(addr + 2) << 16;
+
+    if(pioReadLen && bufOffset + 4 <= pioReadLen)
+    {
+        uint32_t ret = readBuf[bufOffset]
+                     | readBuf[bufOffset + 1] << 8
+                     | readBuf[bufOffset + 2] << 16
+                     | readBuf[bufOffset + 3] << 24;
+        bufOffset += 4;
+
+        // check for end of transfer
+        if(bufOffset == pioReadLen)
+            finishPIORead();
+
+        return ret;
+    }
+
+    // not enough data left, split it (in order, both reads advance the buffer)
+    uint32_t lo = read16(addr);
+    uint32_t hi = read16(addr);
+    return lo | hi << 16;
+}
+
+int ATAController::readBlock(uint16_t addr, uint8_t *buf, int count, int wordSize)
+{
+    // only the data port, which has no byte access
+    if((addr & ~(1 << 7)) != 0x170 || wordSize == 1 || !pioReadLen)
+        return 0;
+
+    // stop at the end of the sector
+    int len = std::min(count, (pioReadLen - bufOffset) / wordSize) * wordSize;
+
+    memcpy(buf, readBuf + bufOffset, len);
+    bufOffset += len;
+
+    if(bufOffset == pioReadLen)
+        finishPIORead();
+
+    return len / wordSize;
+}
+
 void ATAController::write(uint16_t addr, uint8_t data)
 {
     switch(addr & ~(1 << 7))
@@ -206,6 +216,8 @@ void ATAController::write(uint16_t addr, uint8_t data)
         {
             int dev = (deviceHead >> 4) & 1;
 
+            readBuf = sectorBuf;
+
             status &= ~Status_ERR;
             error = 0;
 
@@ -260,7 +272,7 @@ void ATAController::write(uint16_t addr, uint8_t data)
                     status |= Status_BSY;
 
                     // try to read
-                    if(!io || !io->read(this, dev, sectorBuf, lba))
+                    if(!readSector(dev, lba))
                     {
                         status &= ~Status_BSY;
                         status |= Status_ERR;
@@ -475,53 +487,158 @@ void ATAController::write16(uint16_t addr, uint16_t data)
 
                 // check for end of transfer
                 if(bufOffset == pioWriteLen)
-                {
-                    int dev = (deviceHead >> 4) & 1;
-                    bool isATAPICommand = pioWriteLen == 12;
+                    finishPIOWrite();
+            }
 
-                    // clear data request
-                    status &= ~Status_DRQ;
-                    
-                    pioWriteSectors--;
+            break;
+        }
 
-                    // write to disk if this was a sector write
-                    if(!isATAPICommand)
-                    {
-                        status |= Status_BSY;
+        default:
+            printf("ATA W16 %04X = %04X\n", addr, data);
+    }
+}
 
-                        if(!io || !io->write(this, dev, sectorBuf, curLBA))
-                            status |= Status_ERR;
-                    }
+void ATAController::write32(uint16_t addr, uint32_t data)
+{
+    // only the data port supports 32-bit accesses
+    if((addr & ~(1 << 7)) != 0x170)
+    {
+        write16(addr, data);
+        write16(addr + 2, data >> 16);
+        return;
+    }
 
-                    if(pioWriteSectors > 0)
-                    {
-                        // prepare for next sector
-                        curLBA++;
-                        
-                        bufOffset = 0;
-                    }
-                    else
-                    {
-                        pioWriteLen = 0;
+    if(pioWriteLen && bufOffset + 4 <= pioWriteLen)
+    {
+        sectorBuf[bufOffset++] = data & 0xFF;
+        sectorBuf[bufOffset++] = data >> 8;
+        sectorBuf[bufOffset++] = data >> 16;
+        sectorBuf[bufOffset++] = data >> 24;
+
+        // check for end of transfer
+        if(bufOffset == pioWriteLen)
+            finishPIOWrite();
+    }
+    else
+    {
+        write16(addr, data);
+        write16(addr, data >> 16);
+    }
+}
 
-                        if(!isATAPICommand)
-                            flagIRQ();
-                    }
+int ATAController::writeBlock(uint16_t addr, const uint8_t *buf, int count, int wordSize)
+{
+    // only the data port, which has no byte access
+    if((addr & ~(1 << 7)) != 0x170 || wordSize == 1 || !pioWriteLen)
+        return 0;
 
-                    // handle the command if needed
-                    if(isATAPICommand)
-                        doATAPICommand(dev);
-                }
-            }
+    // stop at the end of the sector/command
+    int len = std::min(count, (pioWriteLen - bufOffset) / wordSize) * wordSize;
 
-            break;
+    memcpy(sectorBuf + bufOffset, buf, len);
+    bufOffset += len;
+
+    if(bufOffset == pioWriteLen)
+        finishPIOWrite();
+
+    return len / wordSize;
+}
+
+bool ATAController::readSector(int device, uint32_t lba)
+{
+    if(!io)
+        return false;
+
+    // use the data directly if we can
+    if(auto ptr = io->getSectorPtr(device, lba))
+    {
+        readBuf = ptr;
+        ioComplete(device, true, false);
+        return true;
+    }
+
+    readBuf = sectorBuf;
+    return io->read(this, device, sectorBuf, lba);
+}
+
+void ATAController::finishPIORead()
+{
+    if(pioReadSectors > 1)
+    {
+        // next sector for multi-sector read
+        pioReadSectors--;
+        curLBA++;
+
+        int dev = (deviceHead >> 4) & 1;
+
+        status &= ~Status_DRQ;
+        status |= Status_BSY;
+
+        if(!readSector(dev, curLBA))
+        {
+            status &= ~Status_BSY;
+            status |= Status_ERR;
         }
 
-        default:
-            printf("ATA W16 %04X = %04X\n", addr, data);
+        bufOffset = 0;
+    }
+    else
+    {
+        if(pioReadLen != 512) // atapi
+        {
+            sectorCount = 1 << 0  // command
+                        | 1 << 1; // to host
+        }
+
+        pioReadLen = 0;
+        pioReadSectors = 0;
+
+        // clear data request
+        status &= ~Status_DRQ;
+
+        flagIRQ();
     }
 }
 
+void ATAController::finishPIOWrite()
+{
+    int dev = (deviceHead >> 4) & 1;
+    bool isATAPICommand = pioWriteLen == 12;
+
+    // clear data request
+    status &= ~Status_DRQ;
+    
+    pioWriteSectors--;
+
+    // write to disk if this was a sector write
+    if(!isATAPICommand)
+    {
+        status |= Status_BSY;
+
+        if(!io || !io->write(this, dev, sectorBuf, curLBA))
+            status |= Status_ERR;
+    }
+
+    if(pioWriteSectors > 0)
+    {
+        // prepare for next sector
+        curLBA++;
+        
+        bufOffset = 0;
+    }
+    else
+    {
+        pioWriteLen = 0;
+
+        if(!isATAPICommand)
+            flagIRQ();
+    }
+
+    // handle the command if needed
+    if(isATAPICommand)
+        doATAPICommand(dev);
+}
+
 void ATAController::ioComplete(int device, bool success, bool write)
 {
     status &= ~Status_BSY;
@@ -665,6 +782,8 @@ void ATAController::fillIdentity(int device)
 
 void ATAController::doATAPICommand(int device)
 {
+    readBuf = sectorBuf;
+
     switch(static_cast<SCSICommand>(sectorBuf[0]))
     {
         case SCSICommand::TEST_UNIT_READY:
@@ -785,7 +904,7 @@ void ATAController::doATAPICommand(int device)
 
             status |= Status_BSY;
 
-            if(io && io->read(this, device, sectorBuf, lba))
+            if(readSector(device, lba))
             {
                 pioReadLen = 2048;
                 pioReadSectors = numSectors;
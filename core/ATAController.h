@@ -17,6 +17,10 @@ public:
 
     // writes a 512 byte sector
     virtual bool write(ATAController *controller, int device, const uint8_t *buf, uint32_t lba) = 0;
+
+    // optional direct access to a sector (memory mapped image...), used instead of read if it doesn't return nullptr
+    // the data needs to stay valid until the next access
+    virtual const uint8_t *getSectorPtr(int device, uint32_t lba) {return nullptr;}
 };
 
 class ATAController : public IODevice
@@ -28,15 +32,17 @@ public:
 
     uint8_t read(uint16_t addr) override;
     uint16_t read16(uint16_t addr) override;
+    uint32_t read32(uint16_t addr) override;
 
     void write(uint16_t addr, uint8_t data) override;
     void write16(uint16_t addr, uint16_t data) override;
+    void write32(uint16_t addr, uint32_t data) override;
 
-    void updateForInterrupts(uint8_t mask) override {}
-    int getCyclesToNextInterrupt(uint32_t cycleCount) override {return 0;}
+    int readBlock(uint16_t addr, uint8_t *buf, int count, int wordSize) override;
+    int writeBlock(uint16_t addr, const uint8_t *buf, int count, int wordSize) override;
 
-    uint8_t dmaRead(int ch, bool isLast) override {return 0xFF;}
-    void dmaWrite(int ch, uint8_t data) override {}
+    int dmaRead(int ch, uint8_t *buf, int count, bool isLast) override {return 0;}
+    int dmaWrite(int ch, const uint8_t *buf, int count) override {return 0;}
     void dmaComplete(int ch) override {}
 
     void ioComplete(int device, bool success, bool write);
@@ -44,6 +50,10 @@ public:
     void overrideSectorsPerTrack(int device, unsigned sectors);
 
 private:
+    bool readSector(int device, uint32_t lba);
+    void finishPIORead();
+    void finishPIOWrite();
+
     void calculateCHS(int device);
 
     void fillIdentity(int device);
@@ -67,6 +77,7 @@ private:
     uint8_t deviceControl;
 
     uint8_t sectorBuf[2048];
+    const uint8_t *readBuf = sectorBuf; // sectorBuf or data from getSectorPtr
     int bufOffset = 0;
 
     int pioReadLen = 0;
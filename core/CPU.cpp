@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib> // exit
@@ -7,6 +8,10 @@
 #include "GCCBuiltin.h"
 #include "System.h"
 
+#ifdef PACE_JIT
+#include "JIT.h"
+#endif
+
 enum Flags
 {
     Flag_C = (1 << 0),
@@ -19,6 +24,8 @@ enum Flags
     Flag_D = (1 << 10),
     Flag_O = (1 << 11),
 
+    Flag_Status = Flag_C | Flag_P | Flag_A | Flag_Z | Flag_S | Flag_O,
+
     Flag_IOPL = (3 << 12),
     Flag_NT   = (1 << 14),
     Flag_R    = (1 << 16),
@@ -65,6 +72,9 @@ enum PageFlags
     Page_Dirty    = 1 << 6,
 };
 
+// never matches a page address
+static constexpr uint32_t invalidTLBAccessTag = 1;
+
 // opcode helpers
 
 static constexpr bool parity(uint8_t v)
@@ -88,91 +98,202 @@ template<> struct BiggerInt<int32_t> {using type = int64_t;};
 
 template<class T> using BiggerInt_t=typename BiggerInt<T>::type;
 
+// results are sign extended for LazyFlags, so that S can be checked without knowing the size
 template<class T>
-static T doAdd(T dest, T src, uint32_t &flags)
+static uint32_t signExtend(T v)
 {
-    T res = dest + src;
+    return static_cast<std::make_signed_t<T>>(v);
+}
+
+// lazy flag evaluation, called when something reads the flags
+template<class T, bool carryIn>
+static uint32_t getAddFlags(uint32_t dest32, uint32_t src32, uint32_t res32)
+{
+    T dest = dest32, src = src32, res = res32;
 
+    bool carry = carryIn ? res <= dest : res < dest;
     bool overflow = ~(dest ^ src) & (src ^ res) & signBit<T>();
     bool carry4 = (dest ^ src ^ res) & 0x10;
 
-    flags = (res < dest ? Flag_C : 0) 
-          | (parity(res) ? Flag_P : 0)
-          | (carry4 ? Flag_A : 0)
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (overflow ? Flag_O : 0);
+    return (carry ? Flag_C : 0)
+         | (parity(res) ? Flag_P : 0)
+         | (carry4 ? Flag_A : 0)
+         | (res == 0 ? Flag_Z : 0)
+         | (res & signBit<T>() ? Flag_S : 0)
+         | (overflow ? Flag_O : 0);
+}
+
+template<class T, bool carryIn>
+static uint32_t getSubFlags(uint32_t dest32, uint32_t src32, uint32_t res32)
+{
+    T dest = dest32, src = src32, res = res32;
+
+    bool carry = carryIn ? src >= dest : src > dest;
+    bool overflow = (dest ^ src) & (dest ^ res) & signBit<T>();
+    bool carry4 = (dest ^ src ^ res) & 0x10;
+
+    return (carry ? Flag_C : 0)
+         | (parity(res) ? Flag_P : 0)
+         | (carry4 ? Flag_A : 0)
+         | (res == 0 ? Flag_Z : 0)
+         | (res & signBit<T>() ? Flag_S : 0)
+         | (overflow ? Flag_O : 0);
+}
+
+template<class T>
+static uint32_t getLogicFlags(uint32_t dest32, uint32_t src32, uint32_t res32)
+{
+    T res = res32;
+
+    // c/o cleared
+    // szp set from res
+    // a is "undefined" (but it would seem, also cleared)
+    return (res == 0 ? Flag_Z : 0)
+         | (res & signBit<T>() ? Flag_S : 0)
+         | (parity(res) ? Flag_P : 0);
+}
+
+// c is not modified
+template<class T>
+static uint32_t getIncFlags(uint32_t dest32, uint32_t src32, uint32_t res32)
+{
+    T res = res32;
+
+    return (parity(res) ? Flag_P : 0)
+         | ((res & 0xF) == 0 ? Flag_A : 0)
+         | (res == 0 ? Flag_Z : 0)
+         | (res & signBit<T>() ? Flag_S : 0)
+         | (res == signBit<T>() ? Flag_O : 0);
+}
+
+template<class T>
+static uint32_t getDecFlags(uint32_t dest32, uint32_t src32, uint32_t res32)
+{
+    T res = res32;
+
+    return (parity(res) ? Flag_P : 0)
+         | ((res & 0xF) == 0xF ? Flag_A : 0)
+         | (res == 0 ? Flag_Z : 0)
+         | (res & signBit<T>() ? Flag_S : 0)
+         | (res == signBit<T>() - 1 ? Flag_O : 0);
+}
+
+// src is the shift count for these
+template<class T>
+static uint32_t getShiftLeftFlags(uint32_t dest32, uint32_t count, uint32_t res32)
+{
+    T dest = dest32, res = res32;
+
+    int maxBits = sizeof(T) * 8;
+
+    bool carry = count > unsigned(maxBits) ? 0 : dest & (1 << (maxBits - count));
+
+    // if shift count is > 8 carry is set if the shift count is 16 or 24 and the low bit is set
+    if(sizeof(T) == 1 && count > 8 && (count & 7) == 0)
+        carry = dest & 1;
+
+    // overflow is "undefined" for shift counts other than 1
+    return (carry ? Flag_C : 0)
+         | (parity(res) ? Flag_P : 0)
+         | Flag_A
+         | (res == 0 ? Flag_Z : 0)
+         | (res & signBit<T>() ? Flag_S : 0)
+         | (!!(res & signBit<T>()) != carry ? Flag_O : 0); // msb of result != carry flag
+}
+
+template<class T>
+static uint32_t getShiftRightFlags(uint32_t dest32, uint32_t count, uint32_t res32)
+{
+    T dest = dest32, res = res32;
+
+    int maxBits = sizeof(T) * 8;
+
+    bool carry = count > unsigned(maxBits) ? 0 : dest & (1 << (count - 1));
+
+    // if shift count is > 8 carry is set if the shift count is 16 or 24 and the high bit is set
+    if(sizeof(T) == 1 && count > 8 && (count & 7) == 0)
+        carry = dest >> 7;
+
+    // overflow is "undefined" for shift counts other than 1
+    return (carry ? Flag_C : 0)
+         | (parity(res) ? Flag_P : 0)
+         | Flag_A
+         | (res == 0 ? Flag_Z : 0)
+         | ((res & (signBit<T>() >> 1)) ? Flag_O : 0);
+}
+
+template<class T>
+static uint32_t getShiftRightArithFlags(uint32_t dest32, uint32_t count, uint32_t res32)
+{
+    T dest = dest32, res = res32;
+
+    int maxBits = sizeof(T) * 8;
+
+    // anything >= the total number of bits fills the result with the top bit
+    bool carry = count >= unsigned(maxBits) ? (dest & signBit<T>()) : dest & (1 << (count - 1));
+
+    // overflow is "undefined" for shift counts other than 1
+    // but always cleared as the highest two bits will be the same
+    return (carry ? Flag_C : 0)
+         | (parity(res) ? Flag_P : 0)
+         | Flag_A
+         | (res == 0 ? Flag_Z : 0)
+         | (res & signBit<T>() ? Flag_S : 0);
+}
+
+template<class T>
+static T doAdd(T dest, T src, LazyFlags &flags)
+{
+    T res = dest + src;
+
+    flags.setPending(getAddFlags<T, false>, Flag_Status, dest, src, signExtend(res));
 
     return res;
 }
 
 template<class T>
-static T doAddWithCarry(T dest, T src, uint32_t &flags)
+static T doAddWithCarry(T dest, T src, LazyFlags &flags)
 {
     int c = flags & Flag_C ? 1 : 0;
     T res = dest + src + c;
 
-    bool carry = res < dest || (res == dest && c);
-    bool overflow = ~(dest ^ src) & (src ^ res) & signBit<T>();
-    bool carry4 = (dest ^ src ^ res) & 0x10;
-
-    flags = (carry ? Flag_C : 0) 
-          | (parity(res) ? Flag_P : 0)
-          | (carry4 ? Flag_A : 0)
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (overflow ? Flag_O : 0);
+    flags.setPending(c ? getAddFlags<T, true> : getAddFlags<T, false>, Flag_Status, dest, src, signExtend(res));
 
     return res;
 }
 
 template<class T>
-static T doAnd(T dest, T src, uint32_t &flags)
+static T doAnd(T dest, T src, LazyFlags &flags)
 {
     T res = dest & src;
 
-    // c/o cleared
-    // szp set from res
-    // a is "undefined" (but it would seem, also cleared)
-    flags = (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (parity(res) ? Flag_P : 0);
+    flags.setPending(getLogicFlags<T>, Flag_Status, dest, src, signExtend(res));
 
     return res;
 }
 
 template<class T>
-static T doDec(T dest, uint32_t &flags)
+static T doDec(T dest, LazyFlags &flags)
 {
     T res = dest - 1;
 
-    flags = (flags & Flag_C)
-          | (parity(res) ? Flag_P : 0)
-          | ((res & 0xF) == 0xF ? Flag_A : 0)
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (res == signBit<T>() - 1 ? Flag_O : 0);
+    flags.setPending(getDecFlags<T>, Flag_Status & ~Flag_C, dest, 1, signExtend(res));
 
     return res;
 }
 
 template<class T>
-static T doInc(T dest, uint32_t &flags)
+static T doInc(T dest, LazyFlags &flags)
 {
     T res = dest + 1;
 
-    flags = (flags & Flag_C)
-          | (parity(res) ? Flag_P : 0)
-          | ((res & 0xF) == 0 ? Flag_A : 0)
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (res == signBit<T>() ? Flag_O : 0);
+    flags.setPending(getIncFlags<T>, Flag_Status & ~Flag_C, dest, 1, signExtend(res));
 
     return res;
 }
 
 template<class T>
-static T doMultiplySigned(T dest, T src, uint32_t &flags)
+static T doMultiplySigned(T dest, T src, LazyFlags &flags)
 {
     // use BiggerInt to only do 64-bit multiply if necessary
     auto res = static_cast<BiggerInt_t<T>>(dest) * src;
@@ -187,22 +308,17 @@ static T doMultiplySigned(T dest, T src, uint32_t &flags)
 }
 
 template<class T>
-static T doOr(T dest, T src, uint32_t &flags)
+static T doOr(T dest, T src, LazyFlags &flags)
 {
     T res = dest | src;
 
-    // c/o cleared
-    // szp set from res
-    // a is "undefined"
-    flags = (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (parity(res) ? Flag_P : 0);
+    flags.setPending(getLogicFlags<T>, Flag_Status, dest, src, signExtend(res));
 
     return res;
 }
 
 template<class T>
-static T doRotateLeft(T dest, int count, uint32_t &flags)
+static T doRotateLeft(T dest, int count, LazyFlags &flags)
 {
     if(!count)
         return dest;
@@ -223,7 +339,7 @@ static T doRotateLeft(T dest, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doRotateLeftCarry(T dest, int count, uint32_t &flags)
+static T doRotateLeftCarry(T dest, int count, LazyFlags &flags)
 {
     if(!count)
         return dest;
@@ -264,7 +380,7 @@ static T doRotateLeftCarry(T dest, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doRotateRight(T dest, int count, uint32_t &flags)
+static T doRotateRight(T dest, int count, LazyFlags &flags)
 {
     if(!count)
         return dest;
@@ -285,7 +401,7 @@ static T doRotateRight(T dest, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doRotateRightCarry(T dest, int count, uint32_t &flags)
+static T doRotateRightCarry(T dest, int count, LazyFlags &flags)
 {
     if(!count)
         return dest;
@@ -327,34 +443,22 @@ static T doRotateRightCarry(T dest, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doShiftLeft(T dest, int count, uint32_t &flags)
+static T doShiftLeft(T dest, int count, LazyFlags &flags)
 {
     if(!count)
         return dest;
 
     int maxBits = sizeof(T) * 8;
 
-    bool carry = count > maxBits ? 0 : dest & (1 << (maxBits - count));
-
-    // if shift count is > 8 carry is set if the shift count is 16 or 24 and the low bit is set
-    if(sizeof(T) == 1 && count > 8 && (count & 7) == 0)
-        carry = dest & 1;
-
     T res = count >= maxBits ? 0 : dest << count;
 
-    // overflow is "undefined" for shift counts other than 1
-    flags = (carry ? Flag_C : 0)
-          | (parity(res) ? Flag_P : 0)
-          | Flag_A
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (!!(res & signBit<T>()) != carry ? Flag_O : 0); // msb of result != carry flag
+    flags.setPending(getShiftLeftFlags<T>, Flag_Status, dest, count, signExtend(res));
 
     return res;
 }
 
 template<class T>
-static T doDoubleShiftLeft(T dest, T src, int count, uint32_t &flags)
+static T doDoubleShiftLeft(T dest, T src, int count, LazyFlags &flags)
 {
     if(!count)
         return dest;
@@ -387,58 +491,39 @@ static T doDoubleShiftLeft(T dest, T src, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doShiftRight(T dest, int count, uint32_t &flags)
+static T doShiftRight(T dest, int count, LazyFlags &flags)
 {
     if(!count)
         return dest;
 
     int maxBits = sizeof(T) * 8;
 
-    bool carry = count > maxBits ? 0 : dest & (1 << (count - 1));
-
-    // if shift count is > 8 carry is set if the shift count is 16 or 24 and the high bit is set
-    if(sizeof(T) == 1 && count > 8 && (count & 7) == 0)
-        carry = dest >> 7;
-
     T res = count >= maxBits ? 0 : dest >> count;
 
-    // overflow is "undefined" for shift counts other than 1
-    flags = (carry ? Flag_C : 0)
-          | (parity(res) ? Flag_P : 0)
-          | Flag_A
-          | (res == 0 ? Flag_Z : 0)
-          | ((res & (signBit<T>() >> 1)) ? Flag_O : 0);
+    flags.setPending(getShiftRightFlags<T>, Flag_Status, dest, count, signExtend(res));
 
     return res;
 }
 
 template<class T>
-static T doShiftRightArith(T dest, int count, uint32_t &flags)
+static T doShiftRightArith(T dest, int count, LazyFlags &flags)
 {
     if(!count)
         return dest;
 
     int maxBits = sizeof(T) * 8;
 
-    // anything >= the total number of bits fills the result with the top bit
-    bool carry = count >= maxBits ? (dest & signBit<T>()) : dest & (1 << (count - 1));
-
     std::make_signed_t<T> sDest = dest;
 
     T res = count >= maxBits ? sDest >> (maxBits - 1) : sDest >> count;
-    // overflow is "undefined" for shift counts other than 1
-    // but always cleared as the highest two bits will be the same
-    flags = (carry ? Flag_C : 0)
-          | (parity(res) ? Flag_P : 0)
-          | Flag_A
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0);
+
+    flags.setPending(getShiftRightArithFlags<T>, Flag_Status, dest, count, signExtend(res));
 
     return res;
 }
 
 template<class T>
-static T doDoubleShiftRight(T dest, T src, int count, uint32_t &flags)
+static T doDoubleShiftRight(T dest, T src, int count, LazyFlags &flags)
 {
     if(!count)
         return dest;
@@ -471,61 +556,39 @@ static T doDoubleShiftRight(T dest, T src, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doSub(T dest, T src, uint32_t &flags)
+static T doSub(T dest, T src, LazyFlags &flags)
 {
     T res = dest - src;
 
-    bool overflow = (dest ^ src) & (dest ^ res) & signBit<T>();
-    bool carry4 = (dest ^ src ^ res) & 0x10;
-
-    flags = (src > dest ? Flag_C : 0) 
-          | (parity(res) ? Flag_P : 0)
-          | (carry4 ? Flag_A : 0)
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (overflow ? Flag_O : 0);
+    flags.setPending(getSubFlags<T, false>, Flag_Status, dest, src, signExtend(res));
 
     return res;
 }
 
 template<class T>
-static T doSubWithBorrow(T dest, T src, uint32_t &flags)
+static T doSubWithBorrow(T dest, T src, LazyFlags &flags)
 {
     int c = flags & Flag_C ? 1 : 0;
     T res = dest - src - c;
 
-    bool carry = src > dest || (src == dest && c);
-    bool overflow = (dest ^ src) & (dest ^ res) & signBit<T>();
-    bool carry4 = (dest ^ src ^ res) & 0x10;
-
-    flags = (carry ? Flag_C : 0) 
-          | (parity(res) ? Flag_P : 0)
-          | (carry4 ? Flag_A : 0)
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (overflow ? Flag_O : 0);
+    flags.setPending(c ? getSubFlags<T, true> : getSubFlags<T, false>, Flag_Status, dest, src, signExtend(res));
 
     return res;
 }
 
 template<class T>
-static T doXor(T dest, T src, uint32_t &flags)
+static T doXor(T dest, T src, LazyFlags &flags)
 {
     T res = dest ^ src;
 
-    // c/o cleared
-    // szp set from res
-    // a is "undefined"
-    flags = (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (parity(res) ? Flag_P : 0);
+    flags.setPending(getLogicFlags<T>, Flag_Status, dest, src, signExtend(res));
 
     return res;
 }
 
 // higher level shift wrapper
 template<class T>
-static T doShift(int exOp, T dest, int count, uint32_t &flags)
+static T doShift(int exOp, T dest, int count, LazyFlags &flags)
 {
     count &= 0x1F;
 
@@ -554,8 +617,16 @@ static T doShift(int exOp, T dest, int count, uint32_t &flags)
 
 // checks a condition code
 // used by Jcc/SETcc
-static bool getCondValue(int cond, uint32_t flags)
+static bool getCondValue(int cond, const LazyFlags &lazyFlags)
 {
+    // avoid evaluating everything for JZ/JNZ/JS/JNS
+    if((cond & 0xE) == 0x4 && lazyFlags.isPending(Flag_Z))
+        return (lazyFlags.getResult() == 0) != (cond & 1);
+    if((cond & 0xE) == 0x8 && lazyFlags.isPending(Flag_S))
+        return (lazyFlags.getResult() >> 31) != uint32_t(cond & 1);
+
+    uint32_t flags = lazyFlags;
+
     bool condVal;
     switch(cond)
     {
@@ -599,8 +670,100 @@ static bool getCondValue(int cond, uint32_t flags)
     return condVal;
 }
 
+// approximate 386 clocks for each opcode, using the register/taken forms
+// (memory operands, protected mode checks and faults aren't accounted for)
+static const uint8_t opcodeCycles[256]
+{
+//  0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F
+    2,  2,  2,  2,  2,  2,  2,  7,  2,  2,  2,  2,  2,  2,  2,  3, // 0x
+    2,  2,  2,  2,  2,  2,  2,  7,  2,  2,  2,  2,  2,  2,  2,  7, // 1x
+    2,  2,  2,  2,  2,  2,  0,  4,  2,  2,  2,  2,  2,  2,  0,  4, // 2x
+    2,  2,  2,  2,  2,  2,  0,  4,  2,  2,  2,  2,  2,  2,  0,  4, // 3x
+    2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2, // 4x
+    2,  2,  2,  2,  2,  2,  2,  2,  4,  4,  4,  4,  4,  4,  4,  4, // 5x
+   18, 24, 10, 20,  0,  0,  0,  0,  2, 12,  2, 12, 15, 15, 14, 14, // 6x
+    7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7, // 7x
+    2,  2,  2,  2,  2,  2,  3,  3,  2,  2,  2,  2,  2,  2,  2,  5, // 8x
+    3,  3,  3,  3,  3,  3,  3,  3,  3,  2, 17,  6,  4,  5,  3,  2, // 9x
+    4,  4,  2,  2,  7,  7, 10, 10,  2,  2,  4,  4,  5,  5,  7,  7, // Ax
+    2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2, // Bx
+    3,  3, 10, 10,  7,  7,  2,  2, 10,  4, 18, 18, 33, 37, 35, 22, // Cx
+    3,  3,  3,  3, 17, 19,  2,  5,  2,  2,  2,  2,  2,  2,  2,  2, // Dx
+   11, 11, 11,  9, 12, 12, 10, 10,  7,  7, 12,  7, 13, 13, 11, 11, // Ex
+    0,  2,  0,  0,  5,  2,  8,  8,  2,  2,  2,  2,  2,  2,  5,  5, // Fx
+};
+
+enum class IdleLoopOp
+{
+    Invalid, // may write memory or ports, or isn't handled
+    Other,
+    Branch,
+    PortRead,
+};
+
+// ops that can be part of a polling loop, none of these write to memory
+static IdleLoopOp getIdleLoopOpType(uint8_t opcode)
+{
+    switch(opcode)
+    {
+        case 0x0A: // OR r, r/m
+        case 0x0B:
+        case 0x0C: // OR AL/AX, imm
+        case 0x0D:
+        case 0x22: // AND r, r/m
+        case 0x23:
+        case 0x24: // AND AL/AX, imm
+        case 0x25:
+        case 0x32: // XOR r, r/m
+        case 0x33:
+        case 0x34: // XOR AL/AX, imm
+        case 0x35:
+        case 0x38: // CMP
+        case 0x39:
+        case 0x3A:
+        case 0x3B:
+        case 0x3C:
+        case 0x3D:
+        case 0x84: // TEST r/m, r
+        case 0x85:
+        case 0x8A: // MOV r, r/m
+        case 0x8B:
+        case 0x90: // NOP
+        case 0xA0: // MOV AL/AX, moffs
+        case 0xA1:
+        case 0xA8: // TEST AL/AX, imm
+        case 0xA9:
+            return IdleLoopOp::Other;
+
+        case 0xE4: // IN
+        case 0xE5:
+        case 0xEC:
+        case 0xED:
+            return IdleLoopOp::PortRead;
+
+        case 0xE3: // JCXZ
+        case 0xEB: // JMP
+            return IdleLoopOp::Branch;
+    }
+
+    if(opcode >= 0x70 && opcode <= 0x7F) // Jcc
+        return IdleLoopOp::Branch;
+
+    if(opcode >= 0xB0 && opcode <= 0xBF) // MOV r, imm
+        return IdleLoopOp::Other;
+
+    return IdleLoopOp::Invalid;
+}
+
 CPU::CPU(System &sys) : sys(sys)
+{
+    setClockSpeed(16000000);
+}
+
+#ifdef PACE_JIT
+CPU::~CPU()
 {}
+#endif
 
 void CPU::reset()
 {
@@ -629,14 +792,30 @@ void CPU::reset()
 
     reg(Reg32::EIP) = 0xFFF0;
 
-    for(auto &entry : tlb)
-        entry.tag = 0;
+    flushTLB();
 
-    tlbIndex = 0;
+    for(auto &cr3 : asidCR3)
+        cr3 = ~0u;
+
+    curASID = 0;
+    nextASID = 1;
+    asidCR3[0] = reg(Reg32::CR3) & 0xFFFFF000;
+
+    flushDecodeCache();
+
+#ifdef PACE_JIT
+    if(jit)
+        jit->flush();
+#endif
 
     cpl = 0;
 }
 
+void CPU::setClockSpeed(uint32_t hz)
+{
+    cycleScale = (uint64_t(System::getClockSpeed()) << 16) / hz;
+}
+
 void CPU::run(int ms)
 {
     uint32_t cycles = (System::getClockSpeed() * ms) / 1000;
@@ -647,6 +826,20 @@ void CPU::run(int ms)
 
     uint32_t cycleCount = startCycleCount;
 
+    // advance time to the next interrupt, or the end of this slice
+    auto skipToNextInterrupt = [&]()
+    {
+        uint32_t remaining = cycles - (cycleCount - startCycleCount);
+        int toNext = sys.getNextEventCycle() - cycleCount;
+
+        sys.addSystemCycles(std::min(remaining, uint32_t(std::max(toNext, 1))));
+        sys.runEvents();
+
+        cycleCount = sys.getCycleCount();
+    };
+
+    idleWait = false;
+
     while(cycleCount - startCycleCount < cycles)
     {
         auto oldCycles = cycleCount;
@@ -662,18 +855,102 @@ void CPU::run(int ms)
 
         delayInterrupt = false;
 
-        if(halted) // TODO: sync until interrupt
+        if(halted)
+        {
+            // nothing else is going to advance time
+            if(timingMode == TimingMode::Deterministic)
+            {
+                skipToNextInterrupt();
+                continue;
+            }
+
+            // catch up if we're past the deadline, otherwise let the frontend wait
+            if(int(sys.getNextEventCycle() - sys.getCycleCount()) <= 0)
+            {
+                sys.runEvents();
+
+                if((flags & Flag_I) && chipset.hasInterrupt())
+                    continue;
+            }
             break;
+        }
 
+        opCycles = repElementCycles = 0;
+        lastOpcode = 0x0F; // not valid for idle loops, if nothing gets decoded (or the JIT runs)
+
+#ifdef PACE_JIT
+        if(!jit || !jit->run())
+#endif
         doExecuteInstruction();
 
-        // sync for interrupts
+        // charge for the instruction
+        uint64_t opTotal = opCycles;
+        if(repElementCycles)
+            opTotal += ((repStartCount - reg(Reg32::ECX)) & repCountMask) * repElementCycles;
+
+        executedCycles += opTotal;
+
+        if(timingMode == TimingMode::Deterministic)
+        {
+            uint64_t sysCycles = opTotal * cycleScale + cycleScaleFrac;
+            sys.addSystemCycles(sysCycles >> 16);
+            cycleScaleFrac = sysCycles & 0xFFFF;
+        }
+
+        // idle loop detection
+        auto idleOpType = getIdleLoopOpType(lastOpcode);
+
+        if(idleOpType == IdleLoopOp::Invalid)
+            idleLoopSafe = false;
+        else if(idleOpType == IdleLoopOp::PortRead)
+            idleLoopPortRead = true;
+        else if(idleOpType == IdleLoopOp::Branch && reg(Reg32::EIP) < faultIP && faultIP - reg(Reg32::EIP) <= maxIdleLoopLen)
+        {
+            // back to the start of a short loop, check if anything changed since last time
+            // (not if any of the ports read is something like a counter)
+            bool canIdle = idleLoopSafe && idleLoopPortRead && !idleLoopTimeVaryingRead;
+
+            // flags last, getting them evaluates the lazy flags
+            bool idle = canIdle && reg(Reg32::EIP) == idleLoopIP
+                     && memcmp(idleLoopRegs, regs, sizeof(idleLoopRegs)) == 0 && idleLoopFlags == getFlags();
+
+            idleIterations = idle ? idleIterations + 1 : 0;
+
+            // only keep the state of loops that could be idle, most aren't
+            if(canIdle)
+            {
+                idleLoopIP = reg(Reg32::EIP);
+                memcpy(idleLoopRegs, regs, sizeof(idleLoopRegs));
+                idleLoopFlags = getFlags();
+            }
+            else
+                idleLoopIP = ~0u;
+
+            idleLoopSafe = true;
+            idleLoopPortRead = false;
+            idleLoopTimeVaryingRead = false;
+
+            // only waiting for something to change, which shouldn't happen until an interrupt
+            if(idleIterations >= idleLoopThreshold)
+            {
+                if(timingMode == TimingMode::Deterministic)
+                {
+                    skipToNextInterrupt();
+                    continue;
+                }
+
+                idleWait = true;
+                break;
+            }
+        }
+
+        // run any device events we've reached
         cycleCount = sys.getCycleCount();
         uint32_t exec = cycleCount - oldCycles;
 
-        bool shouldUpdate = sys.getNextInterruptCycle() - oldCycles <= exec;
+        bool shouldUpdate = sys.getNextEventCycle() - oldCycles <= exec;
         if(shouldUpdate)
-            sys.updateForInterrupts();
+            sys.runEvents();
     }
 }
 
@@ -715,6 +992,51 @@ void CPU::dumpTrace()
     trace.dump();
 }
 
+void CPU::watchedPageWrite(uint32_t addr, int width, uint8_t watchFlags)
+{
+    if(watchFlags & System::PageWatch_Code)
+    {
+        // invalidate anything that could overlap the write
+        for(uint32_t opAddr = addr - 14; opAddr != addr + width; opAddr++)
+        {
+            auto &entry = decodeCache[getDecodeCacheIndex(opAddr)];
+            if(entry.physAddr == opAddr)
+            {
+                entry.physAddr = ~0u;
+
+                if(curOp == &entry)
+                    curOp = nullptr;
+            }
+        }
+    }
+
+#ifdef PACE_JIT
+    if(watchFlags & System::PageWatch_JIT)
+        jit->invalidatePage(addr);
+#endif
+
+    // a page directory/table changed, any of the translations could be stale
+    // (but not if this is the page walk updating the accessed/dirty bits)
+    if((watchFlags & System::PageWatch_PageTable) && !updatingPageTables)
+        flushTLB();
+}
+
+#ifdef PACE_JIT
+void CPU::setJITEnabled(bool enabled)
+{
+    if(enabled && !jit)
+        jit = std::make_unique<JIT>(*this);
+    else if(!enabled)
+        jit.reset();
+}
+
+void CPU::setJITVerify(bool verify)
+{
+    if(jit)
+        jit->setVerify(verify);
+}
+#endif
+
 [[gnu::always_inline]] // this has exactly two callers, and one of them is only used by tests
 inline void CPU::doExecuteInstruction()
 {
@@ -739,35 +1061,91 @@ inline void CPU::doExecuteInstruction()
         trace.addEntry(addr, physAddr, opcode, isOperandSize32(false), regs, getFlags());
     }
 
-    // prefixes
-    while(true)
-    {
-        if((opcode & 0xE7) == 0x26) // segment override (26 = ES, 2E = CS, 36 = SS, 3E = DS)
-            segmentOverride = static_cast<Reg16>(static_cast<int>(Reg16::ES) + ((opcode >> 3) & 3)); // the middle two bits
-        else if(opcode == 0x64)
-            segmentOverride = Reg16::FS;
-        else if(opcode == 0x65)
-            segmentOverride = Reg16::GS;
-        else if(opcode == 0x66) // operand size override
-            operandSizeOverride = true;
-        else if(opcode == 0x67)
-            addressSizeOverride = true;
-        else if(opcode == 0xF0) // LOCK
-            lock = true;
-        else if(opcode == 0xF2) // REPNE
-        {
-            rep = true;
-            repZ = false;
-        }
-        else if(opcode == 0xF3) // REP/REPE
-            rep = true;
-        else
-            break;
+    // check for a cached decode of the prefixes
+    auto physAddr = ipPhysBase | (addr & 0xFFF);
+    auto &cached = decodeCache[getDecodeCacheIndex(physAddr)];
 
-        if(!readMemIP8(++addr, opcode))
-            return;
+    curOpAddr = addr;
+
+    if(cached.physAddr == physAddr)
+    {
+        if(cached.prefixLen)
+        {
+            addr += cached.prefixLen;
+            reg(Reg32::EIP) += cached.prefixLen;
+
+            if(addr > ipLimit)
+            {
+                fault(Fault::GP, 0);
+                return;
+            }
+
+            lock = cached.prefixFlags & Prefix_Lock;
+            rep = cached.prefixFlags & Prefix_Rep;
+            repZ = !(cached.prefixFlags & Prefix_RepNZ);
+            segmentOverride = static_cast<Reg16>(cached.segmentOverride);
+            operandSizeOverride = cached.prefixFlags & Prefix_OperandSize;
+            addressSizeOverride = cached.prefixFlags & Prefix_AddressSize;
+        }
+
+        opcode = cached.opcode;
+        curOp = &cached;
+    }
+    else
+    {
+        // prefixes
+        while(true)
+        {
+            if((opcode & 0xE7) == 0x26) // segment override (26 = ES, 2E = CS, 36 = SS, 3E = DS)
+                segmentOverride = static_cast<Reg16>(static_cast<int>(Reg16::ES) + ((opcode >> 3) & 3)); // the middle two bits
+            else if(opcode == 0x64)
+                segmentOverride = Reg16::FS;
+            else if(opcode == 0x65)
+                segmentOverride = Reg16::GS;
+            else if(opcode == 0x66) // operand size override
+                operandSizeOverride = true;
+            else if(opcode == 0x67)
+                addressSizeOverride = true;
+            else if(opcode == 0xF0) // LOCK
+                lock = true;
+            else if(opcode == 0xF2) // REPNE
+            {
+                rep = true;
+                repZ = false;
+            }
+            else if(opcode == 0xF3) // REP/REPE
+                rep = true;
+            else
+                break;
+
+            if(!readMemIP8(++addr, opcode))
+                return;
 
-        reg(Reg32::EIP)++;
+            reg(Reg32::EIP)++;
+        }
+
+        // cache if it doesn't cross a page
+        auto prefixLen = addr - curOpAddr;
+
+        if(!((addr ^ curOpAddr) & ~0xFFF) && prefixLen < 16)
+        {
+            cached.physAddr = physAddr;
+            cached.opcode = opcode;
+            cached.prefixLen = prefixLen;
+            cached.prefixFlags = (lock ? Prefix_Lock : 0)
+                               | (rep ? Prefix_Rep : 0)
+                               | (repZ ? 0 : Prefix_RepNZ)
+                               | (operandSizeOverride ? Prefix_OperandSize : 0)
+                               | (addressSizeOverride ? Prefix_AddressSize : 0);
+            cached.segmentOverride = static_cast<uint8_t>(segmentOverride);
+            cached.modRMOffset = 0;
+
+            sys.addPageWatch(physAddr, System::PageWatch_Code);
+
+            curOp = &cached;
+        }
+        else
+            curOp = nullptr;
     }
 
     // validate LOCK prefix
@@ -777,6 +1155,45 @@ inline void CPU::doExecuteInstruction()
     bool operandSize32 = isOperandSize32(operandSizeOverride);
     addressSize32 = isOperandSize32(addressSizeOverride);
 
+    // timing
+    opCycles = opcodeCycles[opcode];
+    lastOpcode = opcode;
+
+    if(rep)
+    {
+        // clocks per iteration, the count is taken from how much (E)CX changed
+        switch(opcode)
+        {
+            case 0x6C: // INS
+            case 0x6D:
+                repElementCycles = 6;
+                break;
+            case 0x6E: // OUTS
+            case 0x6F:
+            case 0xAA: // STOS
+            case 0xAB:
+            case 0xAC: // LODS
+            case 0xAD:
+                repElementCycles = 5;
+                break;
+            case 0xA4: // MOVS
+            case 0xA5:
+                repElementCycles = 4;
+                break;
+            case 0xA6: // CMPS
+            case 0xA7:
+                repElementCycles = 9;
+                break;
+            case 0xAE: // SCAS
+            case 0xAF:
+                repElementCycles = 8;
+                break;
+        }
+
+        repCountMask = addressSize32 ? 0xFFFFFFFF : 0xFFFF;
+        repStartCount = reg(Reg32::ECX) & repCountMask;
+    }
+
     // with 16-bit operands the high bits of IP should be zeroed
     auto setIP = [this, &operandSize32](uint32_t newIP)
     {
@@ -2463,7 +2880,9 @@ inline void CPU::doExecuteInstruction()
 
                 while(count)
                 {
-                    // TODO: interrupt
+                    if(checkRepInterrupt(count))
+                        break;
+
                     uint8_t src, dest;
                     if(!readMem8(si, segment, src) || !readMem8(di, Reg16::ES, dest))
                         break;
@@ -2546,7 +2965,9 @@ inline void CPU::doExecuteInstruction()
 
                 while(count)
                 {
-                    // TODO: interrupt
+                    if(checkRepInterrupt(count))
+                        break;
+
                     if(operandSize32)
                     {
                         uint32_t src, dest;
@@ -2698,7 +3119,9 @@ inline void CPU::doExecuteInstruction()
 
                 while(count)
                 {
-                    // TODO: interrupt
+                    if(checkRepInterrupt(count))
+                        break;
+
                     uint8_t rSrc;
                     if(!readMem8(di, Reg16::ES, rSrc))
                         break;
@@ -2758,7 +3181,9 @@ inline void CPU::doExecuteInstruction()
 
                 while(count)
                 {
-                    // TODO: interrupt
+                    if(checkRepInterrupt(count))
+                        break;
+
                     if(operandSize32)
                     {
                         uint32_t rSrc;
@@ -3508,6 +3933,7 @@ inline void CPU::doExecuteInstruction()
             if(readMemIP8(addr + 1, port) && checkIOPermission(port))
             {
                 reg(Reg8::AL) = sys.readIOPort(port);
+                idleLoopTimeVaryingRead |= sys.ioPortReadChangesWithTime(port);
 
                 reg(Reg32::EIP)++;
             }
@@ -3519,8 +3945,10 @@ inline void CPU::doExecuteInstruction()
 
             if(readMemIP8(addr + 1, port) && checkIOPermission(port))
             {
+                idleLoopTimeVaryingRead |= sys.ioPortReadChangesWithTime(port);
+
                 if(operandSize32)
-                    reg(Reg32::EAX) = sys.readIOPort16(port) | sys.readIOPort16(port + 2) << 16;
+                    reg(Reg32::EAX) = sys.readIOPort32(port);
                 else
                     reg(Reg16::AX) = sys.readIOPort16(port);
 
@@ -3549,10 +3977,10 @@ inline void CPU::doExecuteInstruction()
                 reg(Reg32::EIP)++;
                 auto data = operandSize32 ? reg(Reg32::EAX) : reg(Reg16::AX);
 
-                sys.writeIOPort16(port, data);
-
                 if(operandSize32)
-                    sys.writeIOPort16(port + 2, data >> 16);
+                    sys.writeIOPort32(port, data);
+                else
+                    sys.writeIOPort16(port, data);
             }
             break;
         }
@@ -3640,7 +4068,10 @@ inline void CPU::doExecuteInstruction()
             auto port = reg(Reg16::DX);
 
             if(checkIOPermission(port))
+            {
                 reg(Reg8::AL) = sys.readIOPort(port);
+                idleLoopTimeVaryingRead |= sys.ioPortReadChangesWithTime(port);
+            }
             break;
         }
         case 0xED: // IN AX from DX
@@ -3649,8 +4080,10 @@ inline void CPU::doExecuteInstruction()
 
             if(checkIOPermission(port))
             {
+                idleLoopTimeVaryingRead |= sys.ioPortReadChangesWithTime(port);
+
                 if(operandSize32)
-                    reg(Reg32::EAX) = sys.readIOPort16(port) | sys.readIOPort16(port + 2) << 16;
+                    reg(Reg32::EAX) = sys.readIOPort32(port);
                 else
                     reg(Reg16::AX) = sys.readIOPort16(port);
             }
@@ -3678,10 +4111,10 @@ inline void CPU::doExecuteInstruction()
             {
                 auto data = operandSize32 ? reg(Reg32::EAX) : reg(Reg16::AX);
 
-                sys.writeIOPort16(port, data);
-
                 if(operandSize32)
-                    sys.writeIOPort16(port + 2, data >> 16);
+                    sys.writeIOPort32(port, data);
+                else
+                    sys.writeIOPort16(port, data);
             }
             break;
         }
@@ -4730,17 +5163,13 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
             auto r = static_cast<Reg32>(((modRM >> 3) & 0x7) + static_cast<int>(Reg32::CR0));
             auto rm = static_cast<Reg32>(modRM & 0x7);
 
+            auto oldVal = reg(r);
             reg(r) = reg(rm);
 
             if(r == Reg32::CR3)
-            {
-                // invalidate TLB
-                for(auto &entry : tlb)
-                    entry.tag &= ~Page_Present;
-
-                // also invalidate our special IP cache
-                ipPtrBase = 0;
-            }
+                switchAddressSpace();
+            else if(r == Reg32::CR0 && ((oldVal ^ reg(r)) & (1u << 31))) // paging enabled/disabled
+                flushTLB();
 
             reg(Reg32::EIP) += 2;
             break;
@@ -5586,6 +6015,12 @@ bool CPU::writeMem32(uint32_t offset, Reg16 segment, uint32_t data)
 
 bool CPU::readMem8(uint32_t offset, uint8_t &data, bool privileged)
 {
+    if(auto ptr = getTLBDirectPtr(offset, false, privileged))
+    {
+        data = *ptr;
+        return true;
+    }
+
     uint32_t physAddr;
     if(!getPhysicalAddress(offset, physAddr, false, privileged))
         return false;
@@ -5609,6 +6044,12 @@ bool CPU::readMem16(uint32_t offset, uint16_t &data, bool privileged)
         return true;
     }
 
+    if(auto ptr = getTLBDirectPtr(offset, false, privileged))
+    {
+        data = *reinterpret_cast<uint16_t *>(ptr);
+        return true;
+    }
+
     uint32_t physAddr;
     if(!getPhysicalAddress(offset, physAddr, false, privileged))
         return false;
@@ -5635,6 +6076,12 @@ bool CPU::readMem32(uint32_t offset, uint32_t &data, bool privileged)
         return true;
     }
 
+    if(auto ptr = getTLBDirectPtr(offset, false, privileged))
+    {
+        data = *reinterpret_cast<uint32_t *>(ptr);
+        return true;
+    }
+
     uint32_t physAddr;
     if(!getPhysicalAddress(offset, physAddr, false, privileged))
         return false;
@@ -5646,6 +6093,12 @@ bool CPU::readMem32(uint32_t offset, uint32_t &data, bool privileged)
 
 bool CPU::writeMem8(uint32_t offset, uint8_t data, bool privileged)
 {
+    if(auto ptr = getTLBDirectPtr(offset, true, privileged))
+    {
+        *ptr = data;
+        return true;
+    }
+
     uint32_t physAddr;
     if(!getPhysicalAddress(offset, physAddr, true, privileged))
         return false;
@@ -5663,6 +6116,12 @@ bool CPU::writeMem16(uint32_t offset, uint16_t data, bool privileged)
         return writeMem8(offset, data & 0xFF, privileged) && writeMem8(offset + 1, data >> 8, privileged);
     }
 
+    if(auto ptr = getTLBDirectPtr(offset, true, privileged))
+    {
+        *reinterpret_cast<uint16_t *>(ptr) = data;
+        return true;
+    }
+
     uint32_t physAddr;
     if(!getPhysicalAddress(offset, physAddr, true, privileged))
         return false;
@@ -5680,6 +6139,12 @@ bool CPU::writeMem32(uint32_t offset, uint32_t data, bool privileged)
             && writeMem8(offset + 2, data >> 16 , privileged) && writeMem8(offset + 3, data >> 24, privileged);
     }
 
+    if(auto ptr = getTLBDirectPtr(offset, true, privileged))
+    {
+        *reinterpret_cast<uint32_t *>(ptr) = data;
+        return true;
+    }
+
     uint32_t physAddr;
     if(!getPhysicalAddress(offset, physAddr, true, privileged))
         return false;
@@ -5691,15 +6156,8 @@ bool CPU::writeMem32(uint32_t offset, uint32_t data, bool privileged)
 bool CPU::readMemIP8(uint32_t offset, uint8_t &data)
 {
     // check if we would cross a page boundary (even if not paging)
-    if(ipPtrBase != offset >> 12)
-    {
-        uint32_t physAddr;
-        if(!getPhysicalAddress(offset, physAddr))
-            return false;
-
-        ipPtr = sys.mapAddress(physAddr) - offset;
-        ipPtrBase = offset >> 12;
-    }
+    if(ipPtrBase != offset >> 12 && !mapIPPtr(offset))
+        return false;
 
     if(offset > ipLimit)
     {
@@ -5737,15 +6195,8 @@ bool CPU::readMemIP16(uint32_t offset, uint16_t &data)
     }
 
     // usual boundary check
-    if(ipPtrBase != offset >> 12)
-    {
-        uint32_t physAddr;
-        if(!getPhysicalAddress(offset, physAddr))
-            return false;
-
-        ipPtr = sys.mapAddress(physAddr) - offset;
-        ipPtrBase = offset >> 12;
-    }
+    if(ipPtrBase != offset >> 12 && !mapIPPtr(offset))
+        return false;
 
     if(offset + 1 > ipLimit)
     {
@@ -5786,15 +6237,8 @@ bool CPU::readMemIP32(uint32_t offset, uint32_t &data)
     }
 
     // usual boundary check
-    if(ipPtrBase != offset >> 12)
-    {
-        uint32_t physAddr;
-        if(!getPhysicalAddress(offset, physAddr))
-            return false;
-
-        ipPtr = sys.mapAddress(physAddr) - offset;
-        ipPtrBase = offset >> 12;
-    }
+    if(ipPtrBase != offset >> 12 && !mapIPPtr(offset))
+        return false;
 
     if(offset + 3 > ipLimit)
     {
@@ -5806,12 +6250,46 @@ bool CPU::readMemIP32(uint32_t offset, uint32_t &data)
     return true;
 }
 
+void CPU::flushDecodeCache()
+{
+    for(auto &entry : decodeCache)
+        entry.physAddr = ~0u;
+
+    curOp = nullptr;
+}
+
+bool CPU::mapIPPtr(uint32_t offset)
+{
+    uint32_t physAddr;
+    if(!getPhysicalAddress(offset, physAddr))
+        return false;
+
+    ipPtr = sys.mapAddress(physAddr) - offset;
+    ipPtrBase = offset >> 12;
+
+    // match the address writes will use for the decode cache
+    ipPhysBase = sys.getA20Address(physAddr) & ~0xFFF;
+
+    return true;
+}
+
 bool CPU::getPhysicalAddress(uint32_t virtAddr, uint32_t &physAddr, bool forWrite, bool privileged)
 {
     // paging not enabled
     if(!(reg(Reg32::CR0) & (1 << 31)))
     {
         physAddr = virtAddr;
+
+        // add an identity mapping to the TLB for direct access
+        auto &entry = tlb[getTLBIndex(virtAddr)];
+        if(entry.tag != ((virtAddr & 0xFFFFF000) | Page_Present | Page_Writable | Page_User | Page_Dirty) || entry.asid != curASID)
+        {
+            entry.tag = (virtAddr & 0xFFFFF000) | Page_Present | Page_Writable | Page_User | Page_Dirty;
+            entry.data = virtAddr & 0xFFFFF000;
+            entry.asid = curASID;
+            updateTLBAccess(entry);
+        }
+
         return true;
     }
 
@@ -5826,16 +6304,10 @@ bool CPU::getPhysicalAddress(uint32_t virtAddr, uint32_t &physAddr, bool forWrit
     bool user = cpl == 3 && !privileged;
 
     // check TLB
-    int set = (virtAddr >> 30) & 3;
-    for(int i = set * 8; i < (set + 1) * 8; i++)
-    {
-        auto &entry = tlb[i];
-
-        if((entry.tag >> 12) != (virtAddr >> 12))
-            continue;
-        if(!(entry.tag & Page_Present))
-            continue;
+    auto &entry = tlb[getTLBIndex(virtAddr)];
 
+    if((entry.tag >> 12) == (virtAddr >> 12) && (entry.tag & Page_Present) && entry.asid == curASID)
+    {
         // okay, we have a hit, validate
         if(user)
         {
@@ -5854,280 +6326,463 @@ bool CPU::getPhysicalAddress(uint32_t virtAddr, uint32_t &physAddr, bool forWrit
             }
         }
 
-        if(forWrite && !(entry.tag & Page_Dirty))
+        if(!forWrite || (entry.tag & Page_Dirty))
         {
-            // fail so we can mark the page dirty
-            // also invalidate the entry
-            entry.tag &= ~Page_Present;
-            break;
+            physAddr = entry.data | (virtAddr & 0xFFF);
+            return true;
+        }
+
+        // fall through to the page table lookup so we can mark the page dirty
+    }
+
+    return lookupPageTable(virtAddr, physAddr, forWrite, user);
+}
+
+bool CPU::lookupPageTable(uint32_t virtAddr, uint32_t &physAddr, bool forWrite, bool user)
+{
+    auto pageFault = [this](bool protection, bool write, uint32_t virtAddr)
+    {
+        reg(Reg32::CR2) = virtAddr;
+        fault(Fault::PF, (protection ? 1 : 0) | (write ? 2 : 0) | (cpl == 3 ? 4 : 0));
+    };
+
+    auto dir = virtAddr >> 22;
+    auto page = (virtAddr >> 12) & 0x3FF;
+
+    walkStats.walks++;
+
+    // directory
+    auto dirEntryAddr = (reg(Reg32::CR3) & 0xFFFFF000) + dir * 4;
+    auto &cachedDir = dirCache[dir & (dirCacheSize - 1)];
+    uint32_t dirEntry;
+
+    if(cachedDir.dir == dir)
+    {
+        dirEntry = cachedDir.entry;
+        walkStats.dirCacheHits++;
+    }
+    else
+    {
+        dirEntry = sys.readMem32(dirEntryAddr);
+        walkStats.tableReads++;
+    }
+
+    // not present
+    if(!(dirEntry & Page_Present))
+    {
+        pageFault(false, forWrite, virtAddr);
+        return false;
+    }
+
+    // page table
+    auto pageEntryAddr = (dirEntry & 0xFFFFF000) + page * 4;
+
+    uint32_t pageEntry = sys.readMem32(pageEntryAddr);
+    walkStats.tableReads++;
+
+    if(!(pageEntry & Page_Present))
+    {
+        pageFault(false, forWrite, virtAddr);
+        return false;
+    }
+
+    auto combinedFlags = pageEntry & dirEntry;
+    
+    if(user)
+    {
+        // writable
+        if(forWrite && !(combinedFlags & Page_Writable))
+        {
+            pageFault(true, forWrite, virtAddr);
+            return false;
         }
 
-        physAddr = entry.data | (virtAddr & 0xFFF);
-        return true;
+        // check user bit
+        if(!(combinedFlags & Page_User))
+        {
+            pageFault(true, forWrite, virtAddr);
+            return false;
+        }
+    }
+
+    updatingPageTables = true;
+
+    // set dir accessed
+    if(!(dirEntry & Page_Accessed))
+    {
+        sys.writeMem(dirEntryAddr, dirEntry | Page_Accessed);
+        walkStats.tableWrites++;
+    }
+
+    // set page accessed/dirty
+    if(!(pageEntry & Page_Accessed) || (forWrite && !(pageEntry & Page_Dirty)))
+    {
+        sys.writeMem(pageEntryAddr, pageEntry | Page_Accessed | (forWrite ? Page_Dirty : 0));
+        walkStats.tableWrites++;
+    }
+
+    updatingPageTables = false;
+
+    // any writes to the tables need to invalidate the TLB
+    // do this first as it might flush (which would also drop the directory watch)
+    watchPageTable(dirEntryAddr);
+
+    if(watchPageTable(pageEntryAddr))
+        watchPageTable(dirEntryAddr);
+
+    // ... and the directory entry cache
+    cachedDir.dir = dir;
+    cachedDir.entry = dirEntry | Page_Accessed;
+
+    physAddr = (pageEntry & 0xFFFFF000) | (virtAddr & 0xFFF);
+
+    // add to TLB
+    // make sure we get the dirty bit
+    auto &entry = tlb[getTLBIndex(virtAddr)];
+    entry.tag = (virtAddr & 0xFFFFF000) | (combinedFlags & 0xFFF & ~Page_Dirty) | (pageEntry & Page_Dirty) | (forWrite ? Page_Dirty : 0);
+    entry.data = pageEntry & 0xFFFFF000;
+    entry.asid = curASID;
+    updateTLBAccess(entry);
+
+    return true;
+}
+
+void CPU::flushTLB()
+{
+    for(auto &entry : tlb)
+    {
+        entry.tag = 0;
+
+        for(auto &tag : entry.accessTag)
+            tag = invalidTLBAccessTag;
+    }
+
+    flushDirCache();
+    walkStats.flushes++;
+
+    // nothing to invalidate anymore
+    for(int i = 0; i < numPageTablePages; i++)
+        sys.removePageWatch(pageTablePages[i], System::PageWatch_PageTable);
+
+    numPageTablePages = 0;
+
+    // also invalidate our special IP cache
+    ipPtrBase = ~0u;
+}
+
+// the 386 flushes the TLB on any CR3 write
+// we keep the entries for a few recent page directories around instead
+// and rely on watching the page tables for writes to keep them valid
+void CPU::switchAddressSpace()
+{
+    auto dirBase = reg(Reg32::CR3) & 0xFFFFF000;
+
+    // the IP cache doesn't know about ASIDs, and neither does the directory cache
+    ipPtrBase = ~0u;
+    flushDirCache();
+
+    for(int i = 0; i < numASIDs; i++)
+    {
+        if(asidCR3[i] == dirBase)
+        {
+            curASID = i;
+            return;
+        }
+    }
+
+    // replace the oldest
+    curASID = nextASID;
+    nextASID = (nextASID + 1) % numASIDs;
+    asidCR3[curASID] = dirBase;
+
+    for(auto &entry : tlb)
+    {
+        if(entry.asid == curASID)
+        {
+            entry.tag = 0;
+
+            for(auto &tag : entry.accessTag)
+                tag = invalidTLBAccessTag;
+        }
     }
-
-    return lookupPageTable(virtAddr, physAddr, forWrite, user);
 }
 
-bool CPU::lookupPageTable(uint32_t virtAddr, uint32_t &physAddr, bool forWrite, bool user)
+void CPU::flushDirCache()
 {
-    auto pageFault = [this](bool protection, bool write, uint32_t virtAddr)
-    {
-        reg(Reg32::CR2) = virtAddr;
-        fault(Fault::PF, (protection ? 1 : 0) | (write ? 2 : 0) | (cpl == 3 ? 4 : 0));
-    };
+    for(auto &entry : dirCache)
+        entry.dir = ~0u;
+}
 
-    auto dir = virtAddr >> 22;
-    auto page = (virtAddr >> 12) & 0x3FF;
+// returns true if the TLB had to be flushed to make room
+bool CPU::watchPageTable(uint32_t addr)
+{
+    // writes can't happen here anyway
+    if(addr >= System::getMaxAddress())
+        return false;
 
-    // directory
-    auto dirEntryAddr = (reg(Reg32::CR3) & 0xFFFFF000) + dir * 4;
-    uint32_t dirEntry = sys.readMem32(dirEntryAddr);
+    // match the address writes will use
+    addr = sys.getA20Address(addr) & 0xFFFFF000;
 
-    // not present
-    if(!(dirEntry & Page_Present))
-    {
-        pageFault(false, forWrite, virtAddr);
+    if(sys.getPageWatch(addr) & System::PageWatch_PageTable)
         return false;
-    }
 
-    // page table
-    auto pageEntryAddr = (dirEntry & 0xFFFFF000) + page * 4;
+    // out of space, start over
+    bool flushed = numPageTablePages == maxPageTablePages;
+    if(flushed)
+        flushTLB();
 
-    uint32_t pageEntry = sys.readMem32(pageEntryAddr);
+    sys.addPageWatch(addr, System::PageWatch_PageTable);
+    pageTablePages[numPageTablePages++] = addr;
 
-    if(!(pageEntry & Page_Present))
-    {
-        pageFault(false, forWrite, virtAddr);
-        return false;
-    }
+    return flushed;
+}
 
-    auto combinedFlags = pageEntry & dirEntry;
-    
-    if(user)
+void CPU::disableTLBDirectWrites(uint32_t physAddr)
+{
+    // writes to the HMA never go direct with A20 disabled, so there's no alias to look for
+    for(auto &entry : tlb)
     {
-        // writable
-        if(forWrite && !(combinedFlags & Page_Writable))
-        {
-            pageFault(true, forWrite, virtAddr);
-            return false;
-        }
-
-        // check user bit
-        if(!(combinedFlags & Page_User))
+        if(((entry.data ^ physAddr) & ~0xFFF) == 0)
         {
-            pageFault(true, forWrite, virtAddr);
-            return false;
+            entry.accessTag[TLBAccess_Write] = invalidTLBAccessTag;
+            entry.accessTag[TLBAccess_UserWrite] = invalidTLBAccessTag;
         }
     }
+}
 
-    // set dir accessed
-    if(!(dirEntry & Page_Accessed))
-        sys.writeMem(dirEntryAddr, dirEntry | Page_Accessed);
+// sets up the direct access tags for a newly filled entry
+void CPU::updateTLBAccess(TLBEntry &entry)
+{
+    auto virtPage = entry.tag & 0xFFFFF000;
+    auto tag = virtPage | entry.asid << 4;
 
-    // set page accessed/dirty
-    if(!(pageEntry & Page_Accessed) || (forWrite && !(pageEntry & Page_Dirty)))
-        sys.writeMem(pageEntryAddr, pageEntry | Page_Accessed | (forWrite ? Page_Dirty : 0));
+    for(auto &accessTag : entry.accessTag)
+        accessTag = invalidTLBAccessTag;
 
-    physAddr = (pageEntry & 0xFFFFF000) | (virtAddr & 0xFFF);
+    // not RAM, needs to go through System
+    auto ptr = sys.getDirectAccessPtr(entry.data, false);
+    if(!ptr)
+        return;
 
-    // add to TLB
-    // IDK how we should allocate this so just go around
-    // make sure we get the dirty bit
-    int set = (virtAddr >> 30) & 3;
-    tlb[set * 8 + tlbIndex].tag = (virtAddr & 0xFFFFF000) | (combinedFlags & 0xFFF) | (forWrite ? Page_Dirty : 0);
-    tlb[set * 8 + tlbIndex].data = pageEntry & 0xFFFFF000;
+    entry.hostPtr = ptr - virtPage;
 
-    tlbIndex = (tlbIndex + 1) % 8;
+    bool user = entry.tag & Page_User;
 
-    return true;
+    entry.accessTag[TLBAccess_Read] = tag;
+
+    if(user)
+        entry.accessTag[TLBAccess_UserRead] = tag;
+
+    // writes have to set the dirty bit first
+    // or the page might be watched
+    if(!(entry.tag & Page_Dirty) || !sys.getDirectAccessPtr(entry.data, true))
+        return;
+
+    // supervisor can always write on a 386
+    entry.accessTag[TLBAccess_Write] = tag;
+
+    if(user && (entry.tag & Page_Writable))
+        entry.accessTag[TLBAccess_UserWrite] = tag;
 }
 
 // reads ModR/M, SIB and displacement, returns reg/offset and address of the next byte after the disp
 // addr is the linear address of the ModR/M byte
 CPU::RM CPU::readModRM(uint32_t addr, uint32_t &endAddr)
 {
+    auto opOffset = addr - curOpAddr;
+
+    // already fetched for this op
+    if(curOp && curOp->modRMOffset == opOffset && curOp->modRMAddressSize32 == addressSize32)
+    {
+        endAddr = addr + 1 + curOp->modRMLen;
+
+        // the limit may have changed since this was cached
+        if(endAddr - 1 > ipLimit)
+        {
+            fault(Fault::GP, 0);
+            return {Reg16::AX, Reg16::IP, 0};
+        }
+
+        reg(Reg32::EIP) += curOp->modRMLen;
+        return decodeModRM(curOp->modRM, curOp->sib, curOp->disp);
+    }
+
     uint8_t modRM;
     if(!readMemIP8(addr, modRM))
         return {Reg16::AX, Reg16::IP, 0}; // the invalid value
 
     auto mod = modRM >> 6;
-    auto r = static_cast<Reg16>((modRM >> 3) & 7);
     auto rm = modRM & 7;
 
-    if(mod == 3) // direct
-    {
-        endAddr = addr + 1;
-        return {r, static_cast<Reg16>(rm), 0};
-    }
-    else
-    {
-        uint32_t memAddr = 0;
-        Reg16 segBase = Reg16::DS;
+    uint8_t sib = 0;
+    uint32_t disp = 0;
 
-        addr++; // the R/M
+    endAddr = addr + 1;
 
+    if(mod != 3)
+    {
         if(addressSize32) // r/m meaning is entirely different in 32bit mode
         {
-            // are there more cases we need to use SS?
-            switch(rm)
+            if(rm == 4)
             {
-                case 0: // EAX
-                case 1: // ECX 
-                case 2: // EDX
-                case 3: // EBX
-                case 6: // ESI
-                case 7: // EDI
-                    memAddr = reg(static_cast<Reg32>(rm));
-                    break;
-
-                case 4: // SIB
-                {
-                    uint8_t sib;
-                    if(!readMemIP8(addr++, sib))
-                        return {Reg16::AX, Reg16::IP, 0};
-
-                    reg(Reg32::EIP)++;
-
-                    int scale = sib >> 6;
-                    int index = (sib >> 3) & 7;
-                    auto base = static_cast<Reg32>(sib & 7);
-
-                    if(mod == 0 && base == Reg32::EBP)
-                    {
-                        // disp32 instead of base
-                        if(!readMemIP32(addr, memAddr))
-                            return {Reg16::AX, Reg16::IP, 0};
-
-                        reg(Reg32::EIP) += 4;
-                        addr += 4;
-                    }
-                    else
-                    {
-                        if(base == Reg32::ESP || base == Reg32::EBP)
-                            segBase = Reg16::SS;
-                        memAddr = reg(base);
-
-                        if(index == 4) // no index
-                            memAddr <<= scale; // undefined behaviour
-                    }
+                if(!readMemIP8(endAddr++, sib))
+                    return {Reg16::AX, Reg16::IP, 0};
+            }
 
-                    if(index != 4) // SP means no index
-                        memAddr += reg(static_cast<Reg32>(index)) << scale;
+            // disp32 instead of base for mod 0
+            bool noBase = mod == 0 && (rm == 5 || (rm == 4 && (sib & 7) == 5));
 
-                    break;
-                }
-                case 5: // ~the same as 6 for 16-bit
-                    if(mod == 0) // direct
-                    {
-                        if(!readMemIP32(addr, memAddr))
-                            return {Reg16::AX, Reg16::IP, 0};
+            if(mod == 2 || noBase)
+            {
+                if(!readMemIP32(endAddr, disp))
+                    return {Reg16::AX, Reg16::IP, 0};
 
-                        reg(Reg32::EIP) += 4;
-                        addr += 4;
-                    }
-                    else
-                    {
-                        // default to stack segment
-                        memAddr = reg(Reg32::EBP);
-                        segBase = Reg16::SS;
-                    }
-                    break;
+                endAddr += 4;
             }
         }
-        else
+        else if(mod == 2 || (mod == 0 && rm == 6))
         {
-            switch(rm)
-            {
-                case 0: // BX + SI
-                    memAddr = reg(Reg16::BX) + reg(Reg16::SI);
-                    break;
-                case 1: // BX + DI
-                    memAddr = reg(Reg16::BX) + reg(Reg16::DI);
-                    break;
-                case 2: // BP + SI
-                    memAddr = reg(Reg16::BP) + reg(Reg16::SI);
-                    segBase = Reg16::SS;
-                    break;
-                case 3: // BP + DI
-                    memAddr = reg(Reg16::BP) + reg(Reg16::DI);
-                    segBase = Reg16::SS;
-                    break;
-                case 4:
-                    memAddr = reg(Reg16::SI);
-                    break;
-                case 5:
-                    memAddr = reg(Reg16::DI);
-                    break;
-                case 6:
-                    if(mod == 0) // direct
-                    {
-                        if(!readMemIP16(addr, memAddr))
-                            return {Reg16::AX, Reg16::IP, 0};
+            if(!readMemIP16(endAddr, disp))
+                return {Reg16::AX, Reg16::IP, 0};
 
-                        reg(Reg32::EIP) += 2;
-                        addr += 2;
-                    }
-                    else
-                    {
-                        // default to stack segment
-                        memAddr = reg(Reg16::BP);
-                        segBase = Reg16::SS;
-                    }
-                    break;
-                case 7:
-                    memAddr = reg(Reg16::BX);
-                    break;
-            }
+            endAddr += 2;
         }
 
-        // add disp
         if(mod == 1)
         {
-            int32_t disp;
-            if(!readMemIP8(addr++, disp))
+            int32_t disp8;
+            if(!readMemIP8(endAddr++, disp8))
                 return {Reg16::AX, Reg16::IP, 0};
 
-            reg(Reg32::EIP)++;
-
-            memAddr += disp;
+            disp = disp8;
         }
-        else if(mod == 2)
-        {
-            if(addressSize32) // 32bit
-            {
-                uint32_t disp;
-                if(!readMemIP32(addr, disp))
-                    return {Reg16::AX, Reg16::IP, 0};
+    }
 
-                reg(Reg32::EIP) += 4;
-                addr += 4;
+    int len = endAddr - addr - 1;
+    reg(Reg32::EIP) += len;
 
-                memAddr += disp;
-            }
-            else //16bit
+    // cache it if we can
+    if(curOp && (!curOp->modRMOffset || curOp->modRMOffset == opOffset) && opOffset < 16 && !(((endAddr - 1) ^ curOpAddr) & ~0xFFF))
+    {
+        curOp->modRMOffset = opOffset;
+        curOp->modRMLen = len;
+        curOp->modRM = modRM;
+        curOp->sib = sib;
+        curOp->modRMAddressSize32 = addressSize32;
+        curOp->disp = disp;
+    }
+
+    return decodeModRM(modRM, sib, disp);
+}
+
+// calculates the register/offset from the fetched ModR/M, SIB and displacement
+CPU::RM CPU::decodeModRM(uint8_t modRM, uint8_t sib, uint32_t disp)
+{
+    auto mod = modRM >> 6;
+    auto r = static_cast<Reg16>((modRM >> 3) & 7);
+    auto rm = modRM & 7;
+
+    if(mod == 3) // direct
+        return {r, static_cast<Reg16>(rm), 0};
+
+    uint32_t memAddr = 0;
+    Reg16 segBase = Reg16::DS;
+
+    if(addressSize32) // r/m meaning is entirely different in 32bit mode
+    {
+        // are there more cases we need to use SS?
+        switch(rm)
+        {
+            case 0: // EAX
+            case 1: // ECX 
+            case 2: // EDX
+            case 3: // EBX
+            case 6: // ESI
+            case 7: // EDI
+                memAddr = reg(static_cast<Reg32>(rm));
+                break;
+
+            case 4: // SIB
             {
-                uint16_t disp;
-                if(!readMemIP16(addr, disp))
-                    return {Reg16::AX, Reg16::IP, 0};
+                int scale = sib >> 6;
+                int index = (sib >> 3) & 7;
+                auto base = static_cast<Reg32>(sib & 7);
 
-                reg(Reg32::EIP) += 2;
-                addr += 2;
+                // mod 0 and base EBP is disp32 instead of base
+                if(mod != 0 || base != Reg32::EBP)
+                {
+                    if(base == Reg32::ESP || base == Reg32::EBP)
+                        segBase = Reg16::SS;
+                    memAddr = reg(base);
 
-                memAddr += disp;
+                    if(index == 4) // no index
+                        memAddr <<= scale; // undefined behaviour
+                }
+
+                if(index != 4) // SP means no index
+                    memAddr += reg(static_cast<Reg32>(index)) << scale;
+
+                break;
             }
+            case 5: // ~the same as 6 for 16-bit
+                if(mod != 0) // mod 0 is direct
+                {
+                    // default to stack segment
+                    memAddr = reg(Reg32::EBP);
+                    segBase = Reg16::SS;
+                }
+                break;
+        }
+    }
+    else
+    {
+        switch(rm)
+        {
+            case 0: // BX + SI
+                memAddr = reg(Reg16::BX) + reg(Reg16::SI);
+                break;
+            case 1: // BX + DI
+                memAddr = reg(Reg16::BX) + reg(Reg16::DI);
+                break;
+            case 2: // BP + SI
+                memAddr = reg(Reg16::BP) + reg(Reg16::SI);
+                segBase = Reg16::SS;
+                break;
+            case 3: // BP + DI
+                memAddr = reg(Reg16::BP) + reg(Reg16::DI);
+                segBase = Reg16::SS;
+                break;
+            case 4:
+                memAddr = reg(Reg16::SI);
+                break;
+            case 5:
+                memAddr = reg(Reg16::DI);
+                break;
+            case 6:
+                if(mod != 0) // mod 0 is direct
+                {
+                    // default to stack segment
+                    memAddr = reg(Reg16::BP);
+                    segBase = Reg16::SS;
+                }
+                break;
+            case 7:
+                memAddr = reg(Reg16::BX);
+                break;
         }
+    }
 
-        // apply segment override
-        if(segmentOverride != Reg16::AX)
-            segBase = segmentOverride;
+    // add disp
+    memAddr += disp;
 
-        if(!addressSize32)
-            memAddr &= 0xFFFF;
+    // apply segment override
+    if(segmentOverride != Reg16::AX)
+        segBase = segmentOverride;
 
-        endAddr = addr;
-        return {r, segBase, memAddr};
-    }
+    if(!addressSize32)
+        memAddr &= 0xFFFF;
+
+    return {r, segBase, memAddr};
 }
 
 CPU::SegmentDescriptor CPU::loadSegmentDescriptor(uint16_t selector)
@@ -6951,6 +7606,30 @@ void CPU::doStringOp(bool addressSize32, Reg16 segmentOverride, bool rep)
     {
         while(count)
         {
+            if(checkRepInterrupt(count))
+                break;
+
+            // copy/fill as much as we can in one go
+            if(step > 0 && count > 1)
+            {
+                auto done = doStringOpBulk<op, useSI, useDI, wordSize>(si, di, count, srcSeg, dstSeg, addressSize32);
+
+                if(done)
+                {
+                    if(useSI) si += done * wordSize;
+                    if(useDI) di += done * wordSize;
+
+                    if(!addressSize32)
+                    {
+                        if(useSI) si &= 0xFFFF;
+                        if(useDI) di &= 0xFFFF;
+                    }
+
+                    count -= done;
+                    continue;
+                }
+            }
+
             // check limits
             if(useSI && !checkSegmentLimit(srcSeg, si, wordSize, segment == Reg16::SS))
                 break;
@@ -6958,7 +7637,6 @@ void CPU::doStringOp(bool addressSize32, Reg16 segmentOverride, bool rep)
             if(useDI && !checkSegmentLimit(dstSeg, di, wordSize))
                 break;
 
-            // TODO: interrupt
             if(!(this->*op)(useSI ? si + srcSeg.base : 0, useDI ? di + dstSeg.base : 0))
                 break;
 
@@ -7001,6 +7679,143 @@ void CPU::doStringOp(bool addressSize32, Reg16 segmentOverride, bool rep)
     }
 }
 
+// checks for an interrupt or device event between iterations of a REP string op
+// if there is one, the op is restarted after it's handled
+bool CPU::checkRepInterrupt(uint32_t count)
+{
+    // always do at least one
+    auto done = (repStartCount - count) & repCountMask;
+    if(!done)
+        return false;
+
+    bool stop = (flags & Flag_I) && sys.getChipset().hasInterrupt();
+
+    if(!stop)
+    {
+        // time doesn't advance until the op is finished in deterministic mode, so add what we've done so far
+        uint32_t cycleCount = sys.getCycleCount();
+        if(timingMode == TimingMode::Deterministic)
+            cycleCount += (uint64_t(done) * repElementCycles * cycleScale) >> 16;
+
+        stop = int(sys.getNextEventCycle() - cycleCount) <= 0;
+    }
+
+    if(stop)
+        reg(Reg32::EIP) = faultIP;
+
+    return stop;
+}
+
+// handles a chunk of a REP string op that doesn't leave a page or segment
+// returns the number of elements done, 0 if the caller should do the next one the slow way
+template<CPU::StringOp op, bool useSI, bool useDI, int wordSize>
+uint32_t CPU::doStringOpBulk(uint32_t si, uint32_t di, uint32_t count, const SegmentDescriptor &srcSeg, const SegmentDescriptor &dstSeg, bool addressSize32)
+{
+    bool isMOVS = op == &CPU::doMOVS8 || op == &CPU::doMOVS16 || op == &CPU::doMOVS32;
+    bool isSTOS = op == &CPU::doSTOS8 || op == &CPU::doSTOS16 || op == &CPU::doSTOS32;
+    bool isLODS = op == &CPU::doLODS8 || op == &CPU::doLODS16 || op == &CPU::doLODS32;
+    bool isINS = op == &CPU::doINS8 || op == &CPU::doINS16 || op == &CPU::doINS32;
+    bool isOUTS = op == &CPU::doOUTS8 || op == &CPU::doOUTS16 || op == &CPU::doOUTS32;
+
+    if(!isMOVS && !isSTOS && !isLODS && !isINS && !isOUTS)
+        return 0;
+
+    // elements left before the end of the segment (or 16-bit wrap)
+    auto getSegmentElements = [this, addressSize32](const SegmentDescriptor &desc, uint32_t offset) -> uint32_t
+    {
+        uint32_t limit = (flags & Flag_VM) ? 0xFFFF : desc.limit;
+
+        // leave expand-down segments to the slow path
+        if(!(flags & Flag_VM) && !(desc.flags & SD_Executable) && (desc.flags & SD_DirConform))
+            return 0;
+
+        if(!addressSize32 && limit > 0xFFFF)
+            limit = 0xFFFF;
+
+        if(offset > limit)
+            return 0;
+
+        return (uint64_t(limit) - offset + 1) / wordSize;
+    };
+
+    uint8_t *srcPtr = nullptr, *dstPtr = nullptr;
+
+    if(useSI)
+    {
+        uint32_t addr = si + srcSeg.base;
+        count = std::min(count, std::min(getSegmentElements(srcSeg, si), (0x1000 - (addr & 0xFFF)) / wordSize));
+
+        srcPtr = getTLBDirectPtr(addr, false, false);
+        if(!srcPtr)
+            return 0;
+    }
+
+    if(useDI)
+    {
+        uint32_t addr = di + dstSeg.base;
+        count = std::min(count, std::min(getSegmentElements(dstSeg, di), (0x1000 - (addr & 0xFFF)) / wordSize));
+
+        // this fails for watched pages (cached code)
+        dstPtr = getTLBDirectPtr(addr, true, false);
+        if(!dstPtr)
+            return 0;
+    }
+
+    if(!count)
+        return 0;
+
+    uint32_t len = count * wordSize;
+
+    if(isMOVS)
+    {
+        // overlapping forwards copies repeat the data
+        if(dstPtr > srcPtr && dstPtr < srcPtr + len)
+        {
+            for(uint32_t i = 0; i < len; i += wordSize)
+            {
+                uint32_t v;
+                memcpy(&v, srcPtr + i, wordSize);
+                memcpy(dstPtr + i, &v, wordSize);
+            }
+        }
+        else
+            memmove(dstPtr, srcPtr, len);
+    }
+    else if(isSTOS)
+    {
+        if(wordSize == 1)
+            memset(dstPtr, reg(Reg8::AL), len);
+        else if(wordSize == 2)
+        {
+            auto v = reg(Reg16::AX);
+            for(uint32_t i = 0; i < len; i += 2)
+                memcpy(dstPtr + i, &v, 2);
+        }
+        else
+        {
+            auto v = reg(Reg32::EAX);
+            for(uint32_t i = 0; i < len; i += 4)
+                memcpy(dstPtr + i, &v, 4);
+        }
+    }
+    else if(isINS) // the device may stop early (end of sector...) or not support block transfers at all
+        count = sys.readIOPortBlock(reg(Reg16::DX), dstPtr, count, wordSize);
+    else if(isOUTS)
+        count = sys.writeIOPortBlock(reg(Reg16::DX), srcPtr, count, wordSize);
+    else // LODS, only the last one matters
+    {
+        auto last = srcPtr + len - wordSize;
+        if(wordSize == 1)
+            reg(Reg8::AL) = *last;
+        else if(wordSize == 2)
+            memcpy(&reg(Reg16::AX), last, 2);
+        else
+            memcpy(&reg(Reg32::EAX), last, 4);
+    }
+
+    return count;
+}
+
 // maybe could reduce these with even more templates, but...
 bool CPU::doINS8(uint32_t si, uint32_t di)
 {
@@ -7014,8 +7829,7 @@ bool CPU::doINS16(uint32_t si, uint32_t di)
 
 bool CPU::doINS32(uint32_t si, uint32_t di)
 {
-    auto v = sys.readIOPort16(reg(Reg16::DX)) | sys.readIOPort16(reg(Reg16::DX) + 2) << 16;
-    return writeMem32(di, v);
+    return writeMem32(di, sys.readIOPort32(reg(Reg16::DX)));
 }
 
 bool CPU::doOUTS8(uint32_t si, uint32_t di)
@@ -7045,8 +7859,7 @@ bool CPU::doOUTS32(uint32_t si, uint32_t di)
     if(!readMem32(si, v))
         return false;
 
-    sys.writeIOPort16(reg(Reg16::DX), v);
-    sys.writeIOPort16(reg(Reg16::DX) + 2, v >> 16);
+    sys.writeIOPort32(reg(Reg16::DX), v);
 
     return true;
 }
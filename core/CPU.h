@@ -2,20 +2,103 @@
 #include <cstdint>
 #include <tuple>
 
+#ifdef PACE_JIT
+#include <memory>
+#endif
+
 #include "CPUTrace.h"
 
 class System;
 
+#ifdef PACE_JIT
+class JIT;
+#endif
+
+// OSZAPC, the flags set by the last ALU op are only calculated when they're read
+class LazyFlags final
+{
+public:
+    using EvalFunc = uint32_t(*)(uint32_t dest, uint32_t src, uint32_t res);
+
+    operator uint32_t() const
+    {
+        evaluate();
+        return value;
+    }
+
+    LazyFlags &operator=(uint32_t v) {value = v; pendingMask = 0; return *this;}
+    LazyFlags &operator|=(uint32_t v) {evaluate(); value |= v; return *this;}
+    LazyFlags &operator&=(uint32_t v) {evaluate(); value &= v; return *this;}
+    LazyFlags &operator^=(uint32_t v) {evaluate(); value ^= v; return *this;}
+
+    // res should be sign extended
+    void setPending(EvalFunc func, uint32_t mask, uint32_t dest, uint32_t src, uint32_t res)
+    {
+        // can't lose any flags that the new op doesn't set
+        if(pendingMask & ~mask)
+            evaluate();
+
+        evalFunc = func;
+        pendingMask = mask;
+        this->dest = dest;
+        this->src = src;
+        this->res = res;
+    }
+
+    void evaluate() const
+    {
+        if(pendingMask)
+        {
+            value = (value & ~pendingMask) | (evalFunc(dest, src, res) & pendingMask);
+            pendingMask = 0;
+        }
+    }
+
+    // Z and S can be checked from the result
+    bool isPending(uint32_t mask) const {return pendingMask & mask;}
+    uint32_t getResult() const {return res;}
+
+    uint32_t *data() {return &value;}
+
+private:
+    mutable uint32_t value = 0;
+    mutable uint32_t pendingMask = 0;
+
+    EvalFunc evalFunc = nullptr;
+    uint32_t dest = 0, src = 0, res = 0;
+};
+
 class CPU final
 {
 public:
 
     CPU(System &sys);
+#ifdef PACE_JIT
+    ~CPU();
+#endif
 
     void reset();
 
     void run(int ms);
 
+    enum class TimingMode
+    {
+        RealTime, // time is advanced by the frontend (System::addCPUCycles)
+        Deterministic, // time only advances with executed instructions
+    };
+
+    void setTimingMode(TimingMode mode) {timingMode = mode;}
+    TimingMode getTimingMode() const {return timingMode;}
+
+    // emulated clock speed for the cycle costs, used in deterministic mode
+    void setClockSpeed(uint32_t hz);
+
+    // estimated from a simplified 386 timing model
+    uint64_t getExecutedCycles() const {return executedCycles;}
+
+    // halted, or stopped in a loop polling a port (in real time mode)
+    bool isIdle() const {return halted || idleWait;}
+
     enum class Reg8
     {
         AL = 0,
@@ -102,6 +185,32 @@ public:
 
     void dumpTrace();
 
+    // called by System on writes to a page with cached state
+    void watchedPageWrite(uint32_t addr, int width, uint8_t watchFlags);
+
+    // counters for TLB misses
+    struct PageWalkStats
+    {
+        uint32_t walks;
+        uint32_t dirCacheHits;
+        uint32_t tableReads; // directory/table entries read from memory
+        uint32_t tableWrites; // accessed/dirty updates
+        uint32_t flushes; // whole TLB
+    };
+
+    const PageWalkStats &getPageWalkStats() const {return walkStats;}
+    void resetPageWalkStats() {walkStats = {};}
+
+    // called by System when the memory map changes
+    void flushTLB();
+    // ... or when a page needs to have writes checked
+    void disableTLBDirectWrites(uint32_t physAddr);
+
+#ifdef PACE_JIT
+    void setJITEnabled(bool enabled);
+    void setJITVerify(bool verify);
+#endif
+
 private:
     enum class Fault
     {
@@ -163,10 +272,53 @@ private:
         uint32_t limit;
     };
 
+    // indices into TLBEntry::accessTag
+    enum TLBAccess
+    {
+        TLBAccess_Read = 0,
+        TLBAccess_Write,
+        TLBAccess_UserRead,
+        TLBAccess_UserWrite,
+    };
+
     struct TLBEntry
     {
-        uint32_t tag;
-        uint32_t data;
+        uint32_t tag; // virtual page | page flags
+        uint32_t data; // physical page
+
+        // virtual page | ASID << 4 if this kind of access can use hostPtr, otherwise invalid
+        uint32_t accessTag[4];
+        uint8_t *hostPtr; // offset by the virtual address
+
+        uint8_t asid;
+    };
+
+    enum PrefixFlags
+    {
+        Prefix_Lock         = 1 << 0,
+        Prefix_Rep          = 1 << 1,
+        Prefix_RepNZ        = 1 << 2,
+        Prefix_OperandSize  = 1 << 3,
+        Prefix_AddressSize  = 1 << 4,
+    };
+
+    // an opcode with its prefixes parsed and ModR/M bytes fetched
+    struct DecodedOp
+    {
+        uint32_t physAddr; // of the first prefix, ~0 if invalid
+
+        uint8_t opcode;
+        uint8_t prefixLen;
+        uint8_t prefixFlags;
+        uint8_t segmentOverride;
+
+        // offset of ModR/M from physAddr, 0 if not decoded yet
+        uint8_t modRMOffset;
+        uint8_t modRMLen; // SIB + displacement
+        uint8_t modRM, sib;
+        bool modRMAddressSize32;
+
+        uint32_t disp;
     };
 
     void doExecuteInstruction();
@@ -202,8 +354,34 @@ private:
 
     bool lookupPageTable(uint32_t virtAddr, uint32_t &physAddr, bool forWrite, bool user);
 
+    // spread out the entries for each address space
+    int getTLBIndex(uint32_t virtAddr) const {return ((virtAddr >> 12) ^ (curASID * (tlbSize / numASIDs))) & (tlbSize - 1);}
+    void updateTLBAccess(TLBEntry &entry);
+
+    // returns a host pointer if the access can bypass System
+    uint8_t *getTLBDirectPtr(uint32_t virtAddr, bool write, bool privileged)
+    {
+        auto &entry = tlb[getTLBIndex(virtAddr)];
+        int access = (write ? TLBAccess_Write : TLBAccess_Read) + (cpl == 3 && !privileged ? TLBAccess_UserRead : 0);
+
+        if(entry.accessTag[access] == ((virtAddr & 0xFFFFF000) | curASID << 4))
+            return entry.hostPtr + virtAddr;
+
+        return nullptr;
+    }
+
+    void switchAddressSpace();
+    void flushDirCache();
+    bool watchPageTable(uint32_t addr);
+
     RM readModRM(uint32_t addr, uint32_t &endAddr);
     RM readModRM(uint32_t addr) {uint32_t tmp; return readModRM(addr, tmp);}
+    RM decodeModRM(uint8_t modRM, uint8_t sib, uint32_t disp);
+
+    bool mapIPPtr(uint32_t offset);
+
+    static int getDecodeCacheIndex(uint32_t physAddr) {return (physAddr ^ (physAddr >> 7)) & (decodeCacheSize - 1);}
+    void flushDecodeCache();
 
     SegmentDescriptor &getCachedSegmentDescriptor(Reg16 r) {return segmentDescriptorCache[static_cast<int>(r) - static_cast<int>(Reg16::ES)];}
     uint32_t getSegmentOffset(Reg16 r) {return getCachedSegmentDescriptor(r).base;}
@@ -240,9 +418,9 @@ private:
     bool writeRM32(const RM &rm, uint32_t v);
 
     // ALU helpers
-    using ALUOp8 = uint8_t(*)(uint8_t, uint8_t, uint32_t &);
-    using ALUOp16 = uint16_t(*)(uint16_t, uint16_t, uint32_t &);
-    using ALUOp32 = uint32_t(*)(uint32_t, uint32_t, uint32_t &);
+    using ALUOp8 = uint8_t(*)(uint8_t, uint8_t, LazyFlags &);
+    using ALUOp16 = uint16_t(*)(uint16_t, uint16_t, LazyFlags &);
+    using ALUOp32 = uint32_t(*)(uint32_t, uint32_t, LazyFlags &);
 
     template<ALUOp8 op, bool d>
     void doALU8(uint32_t addr);
@@ -263,6 +441,9 @@ private:
 
     template<StringOp op, bool useSI, bool useDI, int wordSize>
     void doStringOp(bool addressSize32, Reg16 segmentOverride, bool rep);
+    template<StringOp op, bool useSI, bool useDI, int wordSize>
+    uint32_t doStringOpBulk(uint32_t si, uint32_t di, uint32_t count, const SegmentDescriptor &srcSeg, const SegmentDescriptor &dstSeg, bool addressSize32);
+    bool checkRepInterrupt(uint32_t count);
 
     bool doINS8(uint32_t si, uint32_t di);
     bool doINS16(uint32_t si, uint32_t di);
@@ -307,7 +488,7 @@ private:
     // registers
     uint32_t regs[20]; // segment regs are only 16-bit...
     uint32_t flags;
-    uint32_t statusFlags; // just OSZAPC
+    LazyFlags statusFlags; // just OSZAPC
 
     SegmentDescriptor segmentDescriptorCache[7];
 
@@ -315,8 +496,35 @@ private:
     uint16_t gdtLimit, ldtLimit, idtLimit;
     uint16_t ldtSelector;
 
-    TLBEntry tlb[4 * 8];
-    uint8_t tlbIndex;
+#if defined(PICO_BUILD) || defined(ESP_BUILD)
+    static constexpr int tlbSize = 128;
+#else
+    static constexpr int tlbSize = 256;
+#endif
+    TLBEntry tlb[tlbSize];
+
+    // recently used page directories
+    static constexpr int numASIDs = 4;
+    uint32_t asidCR3[numASIDs];
+    uint8_t curASID = 0, nextASID = 0;
+
+    // pages that TLB entries were loaded from
+    static constexpr int maxPageTablePages = 64;
+    uint32_t pageTablePages[maxPageTablePages];
+    int numPageTablePages = 0;
+    bool updatingPageTables = false;
+
+    // recently used page directory entries, for the current CR3
+    struct DirCacheEntry
+    {
+        uint32_t dir; // index, ~0 if invalid
+        uint32_t entry;
+    };
+
+    static constexpr int dirCacheSize = 16;
+    DirCacheEntry dirCache[dirCacheSize];
+
+    PageWalkStats walkStats = {};
 
     uint8_t cpl;
 
@@ -332,12 +540,50 @@ private:
 
     uint32_t faultIP;
 
+    // timing
+    TimingMode timingMode = TimingMode::RealTime;
+    uint32_t cycleScale = 0; // system clocks per CPU cycle (16.16)
+    uint32_t cycleScaleFrac = 0;
+    uint64_t executedCycles = 0;
+
+    uint8_t opCycles; // base cost of the current op
+    uint8_t lastOpcode;
+    uint8_t repElementCycles; // ... and per-iteration cost if it had a REP prefix
+    uint32_t repStartCount, repCountMask;
+
+    // idle loop detection
+    static constexpr int maxIdleLoopLen = 32; // bytes
+    static constexpr int idleLoopThreshold = 4; // identical iterations
+
+    uint32_t idleLoopIP = ~0u;
+    uint32_t idleLoopRegs[8], idleLoopFlags;
+    int idleIterations = 0;
+    bool idleLoopSafe = false, idleLoopPortRead = false, idleLoopTimeVaryingRead = false;
+    bool idleWait = false;
+
     uint32_t ipPtrBase = 0; // the top 20 bits of the linear IP that was used to map ipPtr
+    uint32_t ipPhysBase = 0; // physical address of the page ipPtr points to
     uint32_t ipLimit; // CS base+limit
     const uint8_t *ipPtr = nullptr;
 
+    // decode cache
+#if defined(PICO_BUILD) || defined(ESP_BUILD)
+    static constexpr int decodeCacheSize = 256;
+#else
+    static constexpr int decodeCacheSize = 4096;
+#endif
+    DecodedOp decodeCache[decodeCacheSize];
+
+    DecodedOp *curOp = nullptr; // cache entry for the executing op, if it could be cached
+    uint32_t curOpAddr; // linear address of the executing op
+
     // RAM
     System &sys;
 
     CPUTrace trace;
+
+#ifdef PACE_JIT
+    friend class JIT;
+    std::unique_ptr<JIT> jit;
+#endif
 };
@@ -1,12 +1,14 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 
 #include "FloppyController.h"
 
 FloppyController::FloppyController(System &sys) : sys(sys)
 {
-    // technically generates IRQ6, but not in a way that requires updateForInterrupts (yet?)
-    sys.addIODevice(0x3F8, 0x3F0, 0, this);
+    // technically generates IRQ6, but not in a way that requires a scheduled event (yet?)
+    sys.addIODevice(0x3F8, 0x3F0, this);
 }
 
 void FloppyController::setIOInterface(FloppyDiskIO *io)
@@ -322,12 +324,14 @@ void FloppyController::write(uint16_t addr, uint8_t data)
     }
 }
 
-uint8_t FloppyController::dmaRead(int ch, bool isLast)
+int FloppyController::dmaRead(int ch, uint8_t *buf, int count, bool isLast)
 {
-    uint8_t ret = sectorBuf[sectorBufOffset++];
+    int len = std::min(count, 512 - sectorBufOffset);
+    memcpy(buf, sectorBuf + sectorBufOffset, len);
+    sectorBufOffset += len;
 
-    // if the DMA word count is zero this is the last transfer, so don't read the next sector
-    if(sectorBufOffset == 512 && !isLast)
+    // if this is the end of the transfer, don't read the next sector
+    if(sectorBufOffset == 512 && !(isLast && len == count))
     {
         int unit = command[1] & 3;
         auto &cylinder = command[2];
@@ -358,12 +362,14 @@ uint8_t FloppyController::dmaRead(int ch, bool isLast)
         sectorBufOffset = 0;
     }
 
-    return ret;
+    return len;
 }
 
-void FloppyController::dmaWrite(int ch, uint8_t data)
+int FloppyController::dmaWrite(int ch, const uint8_t *buf, int count)
 {
-    sectorBuf[sectorBufOffset++] = data;
+    int len = std::min(count, 512 - sectorBufOffset);
+    memcpy(sectorBuf + sectorBufOffset, buf, len);
+    sectorBufOffset += len;
 
     // check if we need to write the next sector
     if(sectorBufOffset == 512)
@@ -395,6 +401,8 @@ void FloppyController::dmaWrite(int ch, uint8_t data)
 
         sectorBufOffset = 0;
     }
+
+    return len;
 }
 
 void FloppyController::dmaComplete(int ch)
@@ -27,15 +27,14 @@ public:
 
     uint8_t read(uint16_t addr) override;
     uint16_t read16(uint16_t addr) override {return read(addr) | read(addr + 1) << 8;}
+    uint32_t read32(uint16_t addr) override {return read16(addr) | read16(addr + 2) << 16;}
 
     void write(uint16_t addr, uint8_t data) override;
     void write16(uint16_t addr, uint16_t data) override {write(addr, data); write(addr + 1, data >> 8);}
+    void write32(uint16_t addr, uint32_t data) override {write16(addr, data); write16(addr + 2, data >> 16);}
 
-    void updateForInterrupts(uint8_t mask) override {};
-    int getCyclesToNextInterrupt(uint32_t cycleCount) override {return 0;}
-
-    uint8_t dmaRead(int ch, bool isLast) override;
-    void dmaWrite(int ch, uint8_t data) override;
+    int dmaRead(int ch, uint8_t *buf, int count, bool isLast) override;
+    int dmaWrite(int ch, const uint8_t *buf, int count) override;
     void dmaComplete(int ch) override;
 
     void ioComplete(int unit, bool success, bool write);
@@ -2,7 +2,7 @@
 
 GamePort::GamePort(System &sys) : sys(sys)
 {
-    sys.addIODevice(0x3FF, 0x201, 0, this);
+    sys.addIODevice(0x3FF, 0x201, this);
 }
 
 uint8_t GamePort::read(uint16_t addr)
@@ -0,0 +1,747 @@
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "JIT.h"
+#include "CPU.h"
+#include "System.h"
+
+// these match CPU.cpp
+static constexpr uint32_t Flag_C = 1 << 0;
+static constexpr uint32_t Flag_A = 1 << 4;
+static constexpr uint32_t Flag_T = 1 << 8;
+static constexpr uint32_t Flag_VM = 1 << 17;
+
+static constexpr uint32_t statusMask = 0x8D5;
+
+// host registers
+enum HostReg
+{
+    RAX = 0,
+    RCX,
+    RDX,
+    RBX,
+
+    R12 = 12,
+};
+
+JIT::JIT(CPU &cpu) : cpu(cpu)
+{
+#ifdef _WIN32
+    codeBuffer = reinterpret_cast<uint8_t *>(VirtualAlloc(nullptr, codeBufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+#else
+    auto ptr = mmap(nullptr, codeBufferSize, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    codeBuffer = ptr == MAP_FAILED ? nullptr : reinterpret_cast<uint8_t *>(ptr);
+#endif
+
+    if(!codeBuffer)
+        printf("Failed to allocate JIT code buffer!\n");
+
+    codePtr = codeBuffer;
+
+    // everything is accessed relative to the registers
+    auto regsAddr = reinterpret_cast<uintptr_t>(cpu.regs);
+    eipOffset = static_cast<int>(reinterpret_cast<uintptr_t>(&cpu.reg(CPU::Reg32::EIP)) - regsAddr);
+    flagsOffset = static_cast<int>(reinterpret_cast<uintptr_t>(cpu.statusFlags.data()) - regsAddr);
+    faultIPOffset = static_cast<int>(reinterpret_cast<uintptr_t>(&cpu.faultIP) - regsAddr);
+}
+
+JIT::~JIT()
+{
+    flush();
+
+#ifdef _WIN32
+    VirtualFree(codeBuffer, 0, MEM_RELEASE);
+#else
+    if(codeBuffer)
+        munmap(codeBuffer, codeBufferSize);
+#endif
+}
+
+bool JIT::run()
+{
+    // only 32-bit protected mode, and not single stepping or tracing
+    if(!codeBuffer || !cpu.codeSizeBit || !cpu.isProtectedMode() || (cpu.flags & (Flag_T | Flag_VM)) || cpu.trace.isEnabled())
+        return false;
+
+    auto addr = cpu.getSegmentOffset(CPU::Reg16::CS) + cpu.reg(CPU::Reg32::EIP);
+
+    // let the interpreter map the page (and handle any faults)
+    if(cpu.ipPtrBase != addr >> 12)
+        return false;
+
+    auto physAddr = cpu.ipPhysBase | (addr & 0xFFF);
+
+    auto &block = blocks[getBlockIndex(physAddr)];
+
+    if(block.physAddr != physAddr)
+    {
+        block = {};
+        block.physAddr = physAddr;
+        return false;
+    }
+
+    if(!block.code)
+    {
+        if(block.execCount == noCompile || ++block.execCount < hotThreshold)
+            return false;
+
+        if(!compile(block))
+        {
+            block.execCount = noCompile;
+            return false;
+        }
+    }
+
+    // also leave limit faults to the interpreter
+    if(addr + block.len - 1 > cpu.ipLimit)
+        return false;
+
+    // compiled code only works with the evaluated flags
+    cpu.statusFlags.evaluate();
+
+    if(verify)
+    {
+        bool ret = runVerify(block);
+        cpu.opCycles = block.numOps * 2;
+        return ret;
+    }
+
+    block.code(cpu.regs);
+
+    // roughly two clocks per op, nothing complicated gets compiled
+    cpu.opCycles = block.numOps * 2;
+
+    return true;
+}
+
+void JIT::invalidatePage(uint32_t addr)
+{
+    auto page = addr & ~0xFFFu;
+
+    for(auto &block : blocks)
+    {
+        if((block.physAddr & ~0xFFFu) == page)
+            block = {};
+    }
+
+    cpu.sys.removePageWatch(page, System::PageWatch_JIT);
+
+    invalidationCount++;
+
+    for(auto it = watchedPages.begin(); it != watchedPages.end(); ++it)
+    {
+        if(*it == page)
+        {
+            watchedPages.erase(it);
+            break;
+        }
+    }
+
+    // stop compiling code from pages that keep getting written
+    for(auto &inval : pageInvalidations)
+    {
+        if(inval.first == page)
+        {
+            inval.second++;
+            return;
+        }
+    }
+
+    // forget the oldest page so this doesn't keep growing
+    if(pageInvalidations.size() == maxInvalidatedPages)
+        pageInvalidations.erase(pageInvalidations.begin());
+
+    pageInvalidations.emplace_back(page, 1);
+}
+
+void JIT::flush()
+{
+    for(auto &block : blocks)
+        block = {};
+
+    for(auto page : watchedPages)
+        cpu.sys.removePageWatch(page, System::PageWatch_JIT);
+
+    watchedPages.clear();
+
+    codePtr = codeBuffer;
+}
+
+bool JIT::compile(Block &block)
+{
+    auto pageAddr = block.physAddr & ~0xFFFu;
+
+    for(auto &inval : pageInvalidations)
+    {
+        if(inval.first == pageAddr && inval.second >= maxPageInvalidations)
+            return false;
+    }
+
+    auto page = cpu.sys.mapAddress(pageAddr);
+    if(!page)
+        return false;
+
+    // helper data goes at the start, followed by the code
+    if(codePtr + maxBlockCodeSize + maxBlockOps * sizeof(MemOp) > codeBuffer + codeBufferSize)
+    {
+        auto physAddr = block.physAddr;
+        flush();
+        block.physAddr = physAddr;
+    }
+
+    auto memOps = reinterpret_cast<MemOp *>(codePtr);
+    int numMemOps = 0;
+    codePtr += maxBlockOps * sizeof(MemOp);
+
+    auto blockCode = codePtr;
+
+    std::vector<uint8_t *> faultFixups;
+
+    // prologue
+    emit(0x53); // push rbx
+    emit(0x41); emit(0x54); // push r12
+    emit(0x48); emit(0x83); emit(0xEC); emit(0x28); // sub rsp, 40 (shadow space + align)
+#ifdef _WIN32
+    emit(0x48); emit(0x89); emit(0xCB); // mov rbx, rcx
+#else
+    emit(0x48); emit(0x89); emit(0xFB); // mov rbx, rdi
+#endif
+    emitRegMem(0x8B, R12, eipOffset); // mov r12d, [EIP]
+
+    auto start = block.physAddr & 0xFFF;
+    uint32_t offset = 0;
+    int numOps = 0;
+    bool endsWithJump = false;
+
+    auto regOffset = [this](int r)
+    {
+        return static_cast<int>(r * sizeof(uint32_t));
+    };
+
+    while(numOps < maxBlockOps && !endsWithJump)
+    {
+        auto code = page + start + offset;
+        int bytesLeft = 0x1000 - (start + offset);
+
+        auto opcode = code[0];
+        int len = 0;
+
+        // ModR/M length, for the ops that can have a memory operand
+        auto getModRMLen = [code, bytesLeft](int modRMOff)
+        {
+            if(bytesLeft <= modRMOff)
+                return 0;
+
+            auto modRM = code[modRMOff];
+            auto mod = modRM >> 6;
+            auto rm = modRM & 7;
+
+            int len = 1;
+
+            if(mod == 3)
+                return len;
+
+            if(rm == 4)
+            {
+                if(bytesLeft <= modRMOff + 1)
+                    return 0;
+                len++;
+            }
+
+            if(mod == 1)
+                len++;
+            else if(mod == 2 || (mod == 0 && (rm == 5 || (rm == 4 && (code[modRMOff + 1] & 7) == 5))))
+                len += 4;
+
+            return len;
+        };
+
+        auto read32 = [code](int off)
+        {
+            return uint32_t(code[off] | code[off + 1] << 8 | code[off + 2] << 16 | code[off + 3] << 24);
+        };
+
+        // the op that gets emitted, ALU ops are the host equivalent
+        bool handled = true;
+
+        switch(opcode)
+        {
+            case 0x01: // ADD r/m32 r32
+            case 0x03: // ADD r32 r/m32
+            case 0x09: // OR
+            case 0x0B:
+            case 0x21: // AND
+            case 0x23:
+            case 0x29: // SUB
+            case 0x2B:
+            case 0x31: // XOR
+            case 0x33:
+            case 0x39: // CMP
+            case 0x3B:
+            case 0x85: // TEST
+            {
+                len = 2;
+                if(bytesLeft < len || (code[1] >> 6) != 3)
+                {
+                    handled = false;
+                    break;
+                }
+
+                int r = (code[1] >> 3) & 7;
+                int rm = code[1] & 7;
+
+                // 0x85 is "r/m, r" but it doesn't write anything
+                bool toReg = opcode & 2;
+                int dest = toReg ? r : rm;
+                int src = toReg ? rm : r;
+
+                bool isCompare = opcode == 0x39 || opcode == 0x3B || opcode == 0x85;
+                bool isLogic = opcode != 0x01 && opcode != 0x03 && opcode != 0x29 && opcode != 0x2B && !isCompare;
+
+                emitRegMem(0x8B, RAX, regOffset(dest)); // mov eax, [dest]
+
+                // op eax, [src]
+                if(opcode == 0x85)
+                    emitRegMem(0x85, RAX, regOffset(src));
+                else
+                    emitRegMem(opcode | 2, RAX, regOffset(src));
+
+                if(!isCompare)
+                    emitRegMem(0x89, RAX, regOffset(dest)); // mov [dest], eax
+
+                // the interpreter clears A for logic ops
+                emitSaveFlags(isLogic || opcode == 0x85 ? statusMask & ~Flag_A : statusMask, false);
+                break;
+            }
+
+            case 0x40: // INC reg32
+            case 0x41:
+            case 0x42:
+            case 0x43:
+            case 0x44:
+            case 0x45:
+            case 0x46:
+            case 0x47:
+            case 0x48: // DEC reg32
+            case 0x49:
+            case 0x4A:
+            case 0x4B:
+            case 0x4C:
+            case 0x4D:
+            case 0x4E:
+            case 0x4F:
+            {
+                len = 1;
+                int r = opcode & 7;
+
+                emitRegMem(0x8B, RAX, regOffset(r)); // mov eax, [r]
+                emit(0xFF); emit(opcode & 8 ? 0xC8 : 0xC0); // inc/dec eax
+                emitRegMem(0x89, RAX, regOffset(r)); // mov [r], eax
+
+                emitSaveFlags(statusMask & ~Flag_C, true);
+                break;
+            }
+
+            case 0x70: // Jcc rel8
+            case 0x71:
+            case 0x72:
+            case 0x73:
+            case 0x74:
+            case 0x75:
+            case 0x76:
+            case 0x77:
+            case 0x78:
+            case 0x79:
+            case 0x7A:
+            case 0x7B:
+            case 0x7C:
+            case 0x7D:
+            case 0x7E:
+            case 0x7F:
+            case 0x0F: // Jcc rel32
+            {
+                int cond;
+                uint32_t target;
+
+                if(opcode == 0x0F)
+                {
+                    len = 6;
+                    if(bytesLeft < len || (code[1] & 0xF0) != 0x80)
+                    {
+                        handled = false;
+                        break;
+                    }
+
+                    cond = code[1] & 0xF;
+                    target = offset + len + read32(2);
+                }
+                else
+                {
+                    len = 2;
+                    if(bytesLeft < len)
+                    {
+                        handled = false;
+                        break;
+                    }
+
+                    cond = opcode & 0xF;
+                    target = offset + len + int8_t(code[1]);
+                }
+
+                // load the guest flags into the host flags
+                emitRegMem(0x8B, RAX, flagsOffset); // mov eax, [flags]
+                emit(0x50); // push rax
+                emit(0x9D); // popfq
+
+                emitLoadEIP(offset + len);
+                // lea ecx, [r12 + target]
+                emit(0x41); emit(0x8D); emit(0x8C); emit(0x24); emit32(target);
+                // cmovcc eax, ecx
+                emit(0x0F); emit(0x40 | cond); emit(0xC1);
+                emitRegMem(0x89, RAX, eipOffset); // mov [EIP], eax
+
+                endsWithJump = true;
+                break;
+            }
+
+            case 0x81: // imm32 op
+            case 0x83: // signed imm8 op
+            {
+                len = opcode == 0x81 ? 6 : 3;
+                int op = (code[1] >> 3) & 7;
+
+                // no ADC/SBB
+                if(bytesLeft < len || (code[1] >> 6) != 3 || op == 2 || op == 3)
+                {
+                    handled = false;
+                    break;
+                }
+
+                int r = code[1] & 7;
+                uint32_t imm = opcode == 0x81 ? read32(2) : uint32_t(int8_t(code[2]));
+
+                emitRegMem(0x8B, RAX, regOffset(r)); // mov eax, [r]
+                emit(op << 3 | 5); emit32(imm); // op eax, imm32
+
+                if(op != 7) // CMP
+                    emitRegMem(0x89, RAX, regOffset(r)); // mov [r], eax
+
+                bool isLogic = op == 1 || op == 4 || op == 6;
+                emitSaveFlags(isLogic ? statusMask & ~Flag_A : statusMask, false);
+                break;
+            }
+
+            case 0x89: // MOV r/m32 r32
+            case 0x8B: // MOV r32 r/m32
+            case 0x8D: // LEA
+            {
+                auto modRMLen = getModRMLen(1);
+                len = 1 + modRMLen;
+                if(!modRMLen || bytesLeft < len || (opcode == 0x8D && (code[1] >> 6) == 3))
+                {
+                    handled = false;
+                    break;
+                }
+
+                int r = (code[1] >> 3) & 7;
+
+                if((code[1] >> 6) == 3)
+                {
+                    int rm = code[1] & 7;
+                    int dest = opcode == 0x89 ? rm : r;
+                    int src = opcode == 0x89 ? r : rm;
+
+                    emitRegMem(0x8B, RAX, regOffset(src));
+                    emitRegMem(0x89, RAX, regOffset(dest));
+                    break;
+                }
+
+                // memory access, call into the CPU
+                auto &memOp = memOps[numMemOps++];
+                memOp.modRM = code[1];
+                memOp.sib = (code[1] & 7) == 4 ? code[2] : 0;
+                memOp.reg = r;
+
+                int dispOff = (code[1] & 7) == 4 ? 3 : 2;
+                int dispLen = len - dispOff;
+
+                if(dispLen == 4)
+                    memOp.disp = read32(dispOff);
+                else if(dispLen == 1)
+                    memOp.disp = int8_t(code[dispOff]);
+                else
+                    memOp.disp = 0;
+
+                // the helpers may fault, so make sure the IP is right
+                emitLoadEIP(offset);
+                emitRegMem(0x89, RAX, faultIPOffset);
+                emitSetEIP(offset + len);
+
+                if(opcode == 0x8D)
+                {
+                    emitCall(reinterpret_cast<const void *>(&JIT::loadEffectiveAddress), &memOp);
+                    break;
+                }
+
+                emitCall(reinterpret_cast<const void *>(opcode == 0x89 ? &JIT::memStore32 : &JIT::memLoad32), &memOp);
+
+                // test eax, eax, jz fault
+                emit(0x85); emit(0xC0);
+                emit(0x0F); emit(0x84);
+                faultFixups.push_back(codePtr);
+                emit32(0);
+                break;
+            }
+
+            case 0x90: // NOP
+                len = 1;
+                break;
+
+            case 0xB8: // MOV imm32 -> reg32
+            case 0xB9:
+            case 0xBA:
+            case 0xBB:
+            case 0xBC:
+            case 0xBD:
+            case 0xBE:
+            case 0xBF:
+            {
+                len = 5;
+                if(bytesLeft < len)
+                {
+                    handled = false;
+                    break;
+                }
+
+                // mov dword [r], imm32
+                emitRegMem(0xC7, 0, regOffset(opcode & 7));
+                emit32(read32(1));
+                break;
+            }
+
+            case 0xE9: // JMP near
+            case 0xEB: // JMP short
+            {
+                len = opcode == 0xE9 ? 5 : 2;
+                if(bytesLeft < len)
+                {
+                    handled = false;
+                    break;
+                }
+
+                uint32_t target = offset + len + (opcode == 0xE9 ? read32(1) : uint32_t(int8_t(code[1])));
+                emitSetEIP(target);
+
+                endsWithJump = true;
+                break;
+            }
+
+            default:
+                handled = false;
+        }
+
+        if(!handled)
+            break;
+
+        offset += len;
+        numOps++;
+    }
+
+    if(!numOps)
+    {
+        codePtr = reinterpret_cast<uint8_t *>(memOps);
+        return false;
+    }
+
+    if(!endsWithJump)
+        emitSetEIP(offset);
+
+    emit(0xB8); emit32(1); // mov eax, 1
+    emitEpilogue();
+
+    // helper faulted, EIP has already been updated
+    if(!faultFixups.empty())
+    {
+        for(auto fixup : faultFixups)
+        {
+            auto rel = static_cast<uint32_t>(codePtr - (fixup + 4));
+            memcpy(fixup, &rel, 4);
+        }
+
+        emit(0x31); emit(0xC0); // xor eax, eax
+        emitEpilogue();
+    }
+
+    block.code = reinterpret_cast<BlockFunc>(blockCode);
+    block.numOps = numOps;
+    block.len = offset;
+
+    // watch for writes
+    if(!(cpu.sys.getPageWatch(pageAddr) & System::PageWatch_JIT))
+    {
+        cpu.sys.addPageWatch(pageAddr, System::PageWatch_JIT);
+        watchedPages.push_back(pageAddr);
+    }
+
+    return true;
+}
+
+bool JIT::runVerify(Block &block)
+{
+    static const char *regNames[]{"EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI", "EIP"};
+
+    uint32_t regsBefore[9], regsJIT[9];
+
+    memcpy(regsBefore, cpu.regs, sizeof(regsBefore));
+    uint32_t flagsBefore = cpu.statusFlags;
+    auto invalidationsBefore = invalidationCount;
+
+    // if something faulted there's too much state to restore
+    if(!block.code(cpu.regs))
+        return true;
+
+    // compiled code got written to (maybe this block), replaying the modified code wouldn't match
+    if(invalidationCount != invalidationsBefore)
+        return true;
+
+    memcpy(regsJIT, cpu.regs, sizeof(regsJIT));
+    uint32_t flagsJIT = cpu.statusFlags;
+
+    // now run the same ops through the interpreter
+    // (memory isn't restored, so a block that reads back something it wrote can report a false mismatch)
+    memcpy(cpu.regs, regsBefore, sizeof(regsBefore));
+    cpu.statusFlags = flagsBefore;
+
+    for(int i = 0; i < block.numOps; i++)
+        cpu.executeInstruction();
+
+    uint32_t flagsInterp = cpu.statusFlags;
+
+    if(memcmp(regsJIT, cpu.regs, sizeof(regsJIT)) == 0 && flagsJIT == flagsInterp)
+        return true;
+
+    printf("JIT mismatch in block at %08X (%i ops, %i bytes)\n", block.physAddr, block.numOps, block.len);
+
+    for(int i = 0; i < 9; i++)
+    {
+        if(regsJIT[i] != cpu.regs[i])
+            printf("\t%s JIT %08X interpreter %08X\n", regNames[i], regsJIT[i], cpu.regs[i]);
+    }
+
+    if(flagsJIT != flagsInterp)
+        printf("\tflags JIT %03X interpreter %03X\n", flagsJIT, flagsInterp);
+
+    // the interpreter's result is kept, don't use this block again
+    block.code = nullptr;
+    block.execCount = noCompile;
+
+    return true;
+}
+
+void JIT::emit32(uint32_t v)
+{
+    memcpy(codePtr, &v, 4);
+    codePtr += 4;
+}
+
+void JIT::emit64(uint64_t v)
+{
+    memcpy(codePtr, &v, 8);
+    codePtr += 8;
+}
+
+void JIT::emitRegMem(uint8_t op, int hostReg, int offset)
+{
+    if(hostReg >= 8)
+        emit(0x44); // REX.R
+
+    emit(op);
+    emit(0x80 | (hostReg & 7) << 3 | RBX); // [rbx + disp32]
+    emit32(offset);
+}
+
+void JIT::emitLoadEIP(int offset)
+{
+    // lea eax, [r12 + offset]
+    emit(0x41); emit(0x8D); emit(0x84); emit(0x24);
+    emit32(offset);
+}
+
+void JIT::emitSetEIP(int offset)
+{
+    emitLoadEIP(offset);
+    emitRegMem(0x89, RAX, eipOffset);
+}
+
+void JIT::emitSaveFlags(uint32_t mask, bool keepCarry)
+{
+    emit(0x9C); // pushfq
+    emit(0x59); // pop rcx
+    emit(0x81); emit(0xE1); emit32(mask); // and ecx, mask
+
+    if(keepCarry)
+    {
+        emitRegMem(0x8B, RDX, flagsOffset); // mov edx, [flags]
+        emit(0x83); emit(0xE2); emit(Flag_C); // and edx, C
+        emit(0x09); emit(0xD1); // or ecx, edx
+    }
+
+    emitRegMem(0x89, RCX, flagsOffset); // mov [flags], ecx
+}
+
+void JIT::emitCall(const void *func, const void *arg)
+{
+#ifdef _WIN32
+    emit(0x48); emit(0xB9); emit64(reinterpret_cast<uintptr_t>(&cpu)); // mov rcx, cpu
+    emit(0x48); emit(0xBA); emit64(reinterpret_cast<uintptr_t>(arg)); // mov rdx, arg
+#else
+    emit(0x48); emit(0xBF); emit64(reinterpret_cast<uintptr_t>(&cpu)); // mov rdi, cpu
+    emit(0x48); emit(0xBE); emit64(reinterpret_cast<uintptr_t>(arg)); // mov rsi, arg
+#endif
+    emit(0x48); emit(0xB8); emit64(reinterpret_cast<uintptr_t>(func)); // mov rax, func
+    emit(0xFF); emit(0xD0); // call rax
+}
+
+void JIT::emitEpilogue()
+{
+    emit(0x48); emit(0x83); emit(0xC4); emit(0x28); // add rsp, 40
+    emit(0x41); emit(0x5C); // pop r12
+    emit(0x5B); // pop rbx
+    emit(0xC3); // ret
+}
+
+int JIT::memLoad32(CPU *cpu, const MemOp *op)
+{
+    // blocks never have prefixes
+    cpu->addressSize32 = true;
+    cpu->segmentOverride = CPU::Reg16::AX;
+
+    auto rm = cpu->decodeModRM(op->modRM, op->sib, op->disp);
+    return cpu->readRM32(rm, cpu->reg(static_cast<CPU::Reg32>(op->reg)));
+}
+
+int JIT::memStore32(CPU *cpu, const MemOp *op)
+{
+    cpu->addressSize32 = true;
+    cpu->segmentOverride = CPU::Reg16::AX;
+
+    auto rm = cpu->decodeModRM(op->modRM, op->sib, op->disp);
+    return cpu->writeRM32(rm, cpu->reg(static_cast<CPU::Reg32>(op->reg)));
+}
+
+int JIT::loadEffectiveAddress(CPU *cpu, const MemOp *op)
+{
+    cpu->addressSize32 = true;
+    cpu->segmentOverride = CPU::Reg16::AX;
+
+    auto rm = cpu->decodeModRM(op->modRM, op->sib, op->disp);
+    cpu->reg(static_cast<CPU::Reg32>(op->reg)) = rm.offset;
+    return 1;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+class CPU;
+
+// translates hot blocks of 32-bit protected mode code to x86-64
+// anything not handled here ends the block and is left to the interpreter
+class JIT final
+{
+public:
+    JIT(CPU &cpu);
+    ~JIT();
+
+    // runs a compiled block at the current CS:EIP if there is one, returns false if nothing was run
+    bool run();
+
+    // compare the results of each block with the interpreter
+    void setVerify(bool verify) {this->verify = verify;}
+
+    void invalidatePage(uint32_t addr);
+    void flush();
+
+private:
+    using BlockFunc = int(*)(uint32_t *regs);
+
+    struct Block
+    {
+        uint32_t physAddr = ~0u;
+        uint16_t execCount = 0;
+        uint16_t numOps = 0;
+        uint32_t len = 0; // in guest bytes
+        BlockFunc code = nullptr;
+    };
+
+    // passed to the memory helpers
+    struct MemOp
+    {
+        uint8_t modRM, sib;
+        uint8_t reg;
+        uint32_t disp;
+    };
+
+    bool compile(Block &block);
+    bool runVerify(Block &block);
+
+    // emitter
+    void emit(uint8_t b) {*codePtr++ = b;}
+    void emit32(uint32_t v);
+    void emit64(uint64_t v);
+    void emitRegMem(uint8_t op, int hostReg, int offset); // op reg, [rbx + offset]
+    void emitLoadEIP(int offset); // eax = entry EIP + offset
+    void emitSetEIP(int offset);
+    void emitSaveFlags(uint32_t mask, bool keepCarry);
+    void emitCall(const void *func, const void *arg);
+    void emitEpilogue();
+
+    static int memLoad32(CPU *cpu, const MemOp *op);
+    static int memStore32(CPU *cpu, const MemOp *op);
+    static int loadEffectiveAddress(CPU *cpu, const MemOp *op);
+
+    static int getBlockIndex(uint32_t physAddr) {return (physAddr ^ (physAddr >> 9)) & (blockTableSize - 1);}
+
+    static constexpr int blockTableSize = 4096;
+    static constexpr int hotThreshold = 32;
+    static constexpr int maxBlockOps = 32;
+    static constexpr uint16_t noCompile = 0xFFFF;
+    static constexpr int maxPageInvalidations = 8;
+    static constexpr size_t maxInvalidatedPages = 64;
+
+    static constexpr size_t codeBufferSize = 16 * 1024 * 1024;
+    static constexpr size_t maxBlockCodeSize = 4096;
+
+    CPU &cpu;
+
+    Block blocks[blockTableSize];
+
+    uint8_t *codeBuffer = nullptr;
+    uint8_t *codePtr = nullptr;
+
+    // pages with compiled code, and how many times they've been invalidated (oldest first)
+    std::vector<uint32_t> watchedPages;
+    std::vector<std::pair<uint32_t, int>> pageInvalidations;
+    unsigned int invalidationCount = 0;
+
+    // offsets from regs of other state the compiled code touches
+    int eipOffset, flagsOffset, faultIPOffset;
+
+    bool verify = false;
+};
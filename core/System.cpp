@@ -15,8 +15,13 @@
 
 Chipset::Chipset(System &sys) : sys(sys)
 {
-    for(auto &dev : dma.requestedDev)
-        dev = nullptr;
+    for(int i = 0; i < 2; i++)
+    {
+        dma[i].firstChannel = i * 4;
+
+        for(auto &dev : dma[i].requestedDev)
+            dev = nullptr;
+    }
 
     // 0 would be invalid for these
     cmosRam[0x07] = 1; // day of month
@@ -44,43 +49,15 @@ uint8_t Chipset::read(uint16_t addr)
     switch(addr)
     {
         // case 0x00: // DMA channel 0 addr
-        case 0x02: // DMA channel 1 addr
-        case 0x04: // DMA channel 2 addr
-        case 0x06: // DMA channel 3 addr
-        {
-            int channel = addr / 2;
-
-
-            uint8_t ret;
-            if(dma.flipFlop)
-                ret = dma.currentAddress[channel] >> 8;
-            else
-                ret = dma.currentAddress[channel] & 0xFF;
-
-            dma.flipFlop = !dma.flipFlop;
-
-            return ret;
-        }
         // case 0x01: // DMA channel 0 word count
+        case 0x02: // DMA channel 1 addr
         case 0x03: // DMA channel 1 word count
+        case 0x04: // DMA channel 2 addr
         case 0x05: // DMA channel 2 word count
+        case 0x06: // DMA channel 3 addr
         case 0x07: // DMA channel 3 word count
-        {
-            int channel = addr / 2;
-
-            uint8_t ret;
-            if(dma.flipFlop)
-                ret = dma.currentWordCount[channel] >> 8;
-            else
-                ret = dma.currentWordCount[channel] & 0xFF;
-
-            dma.flipFlop = !dma.flipFlop;
-
-            return ret;
-        }
-
         case 0x08: // DMA status
-            return dma.status;
+            return dma[0].read(addr);
 
         case 0x20: // PIC request/service (OCW3)
             return pic[0].read(0);
@@ -165,13 +142,21 @@ uint8_t Chipset::read(uint16_t addr)
             return cmosRam[cmosIndex];
 
         case 0x80: // not actually channel 0 high addr
-            return dma.highAddr[0];
+            return dma[0].highAddr[0];
         case 0x81: // DMA channel 2 high addr
-            return dma.highAddr[2];
+            return dma[0].highAddr[2];
         case 0x82: // DMA channel 3 high addr
-            return dma.highAddr[3];
+            return dma[0].highAddr[3];
         case 0x83: // DMA channel 1 high addr
-            return dma.highAddr[1];
+            return dma[0].highAddr[1];
+        case 0x89: // DMA channel 6 high addr
+            return dma[1].highAddr[2];
+        case 0x8A: // DMA channel 7 high addr
+            return dma[1].highAddr[3];
+        case 0x8B: // DMA channel 5 high addr
+            return dma[1].highAddr[1];
+        case 0x8F: // DMA channel 4 high addr (refresh)
+            return dma[1].highAddr[0];
 
         case 0x92: // system control port A
             return systemControlA;
@@ -181,6 +166,17 @@ uint8_t Chipset::read(uint16_t addr)
         case 0xA1: // second PIC mask (OCW1)
             return pic[1].read(1);
 
+        case 0xC0: // DMA channel 4 addr
+        case 0xC2: // DMA channel 4 word count
+        case 0xC4: // DMA channel 5 addr
+        case 0xC6: // DMA channel 5 word count
+        case 0xC8: // DMA channel 6 addr
+        case 0xCA: // DMA channel 6 word count
+        case 0xCC: // DMA channel 7 addr
+        case 0xCE: // DMA channel 7 word count
+        case 0xD0: // second DMA status
+            return dma[1].read((addr - 0xC0) / 2);
+
 #ifndef NDEBUG
         default:
             auto [cs, ip, opAddr] = sys.getCPU().getOpStartAddr();
@@ -196,90 +192,21 @@ void Chipset::write(uint16_t addr, uint8_t data)
     switch(addr)
     {
         //case 0x00: // DMA channel 0 addr
-        case 0x02: // DMA channel 1 addr
-        case 0x04: // DMA channel 2 addr
-        case 0x06: // DMA channel 3 addr
-        {
-            int channel = addr / 2;
-
-            if(dma.flipFlop)
-                dma.currentAddress[channel] = dma.baseAddress[channel] = (dma.baseAddress[channel] & 0xFF) | data << 8;
-            else
-                dma.baseAddress[channel] = (dma.baseAddress[channel] & 0xFF00) | data;
-
-            dma.flipFlop = !dma.flipFlop;
-            break;
-        }
-
         //case 0x01: // DMA channel 0 word count
+        case 0x02: // DMA channel 1 addr
         case 0x03: // DMA channel 1 word count
+        case 0x04: // DMA channel 2 addr
         case 0x05: // DMA channel 2 word count
+        case 0x06: // DMA channel 3 addr
         case 0x07: // DMA channel 3 word count
-        {
-            int channel = addr / 2;
-
-            if(dma.flipFlop)
-                dma.currentWordCount[channel] = dma.baseWordCount[channel] = (dma.baseWordCount[channel] & 0xFF) | data << 8;
-            else
-                dma.baseWordCount[channel] = (dma.baseWordCount[channel] & 0xFF00) | data;
-
-            dma.flipFlop = !dma.flipFlop;
-            break;
-        }
-
         case 0x08: // DMA command
-            dma.command = data;
-            break;
         case 0x09: // DMA request
-        {
-            int channel = data & 3;
-            if(data & (1 << 2))
-                dma.request |= 1 << channel;
-            else
-                dma.request &= ~(1 << channel);
-            break;
-        }
         case 0x0A: // DMA mask
-        {
-            int channel = data & 3;
-            if(data & (1 << 2))
-                dma.mask |= 1 << channel;
-            else
-                dma.mask &= ~(1 << channel);
-            break;
-        }
         case 0x0B: // DMA mode
-        {
-            int channel = data & 3;
-            int dir = (data >> 2) & 3;
-            bool autoInit = data & (1 << 4);
-            bool dec = data & (1 << 5);
-            int mode = data >> 6;
-
-            static const char *dirStr[]{"verify", "write", "read", "ILLEGAL"};
-            static const char *modeStr[]{"demand", "single", "block", "cascade"};
-
-            if(mode != 1)
-                printf("DMA ch%i %s%s %s %s\n", channel, autoInit ? "auto-init ": "", modeStr[mode], dirStr[dir], dec ? "decrement" : "increment");
-
-            dma.mode[channel] = data;
-            break;
-        }
         case 0x0C: // DMA reset flip-flop
-        {
-            dma.flipFlop = false;
-            break;
-        }
-
         case 0x0D: // DMA master clear
-        {
-            dma.command = 0;
-            dma.status = 0;
-            dma.request = 0;
-            dma.flipFlop = false;
-            dma.mask = 0xF;
+            dma[0].write(addr, data);
             break;
-        }
 
         case 0x20: // PIC ICW1, OCW 2/3
             pic[0].write(0, data);
@@ -291,19 +218,14 @@ void Chipset::write(uint16_t addr, uint8_t data)
             {
                 auto enabled = pic[0].mask & ~data;
 
-                if(enabled)
-                {
-                    // sync devices that are getting their IRQ unmasked
-                    if(enabled & 1)
-                        updatePIT();
-
-                    sys.updateForInterrupts(enabled, data);
-                }
+                // sync the timer if it's getting its IRQ unmasked
+                if(enabled & 1)
+                    updatePIT();
             }
 
             pic[0].write(1, data);
 
-            sys.calculateNextInterruptCycle(sys.getCycleCount());
+            updatePITEvent();
             updateMaskedPICRequest();
 
             break;
@@ -348,8 +270,7 @@ void Chipset::write(uint16_t addr, uint8_t data)
                         else // mode 2/3/4 start high
                             pit.outState |= (1 << channel);
 
-                        calculateNextPITUpdate();
-                        sys.calculateNextInterruptCycle(sys.getCycleCount());
+                        updatePITEvent();
                     }
                 }
 
@@ -380,7 +301,7 @@ void Chipset::write(uint16_t addr, uint8_t data)
                     {
                         if(chans & (1 << i))
                         {
-                            pit.latch[i] = pit.counter[0];
+                            pit.latch[i] = pit.counter[i];
                             pit.latched |= (1 << i);
                         }
                     }
@@ -411,8 +332,7 @@ void Chipset::write(uint16_t addr, uint8_t data)
                 printf("PIT ch%i access %i mode %i\n", channel, access, mode);
 #endif
 
-                calculateNextPITUpdate();
-                sys.calculateNextInterruptCycle(sys.getCycleCount());
+                updatePITEvent();
             }
 
             break;
@@ -437,6 +357,13 @@ void Chipset::write(uint16_t addr, uint8_t data)
         }
 
         case 0x61: // system control B
+            // sync ch2 and the speaker before changing the gate/data
+            if((systemControlB ^ data) & 3)
+            {
+                updatePIT();
+                updateSpeaker(sys.getCycleCount());
+            }
+
             systemControlB = data;
             break;
 
@@ -459,50 +386,73 @@ void Chipset::write(uint16_t addr, uint8_t data)
         }
 
         case 0x80:
-            dma.highAddr[0] = data;
+            dma[0].highAddr[0] = data;
             break;
         case 0x81: // DMA channel 2 high addr
-            dma.highAddr[2] = data;
+            dma[0].highAddr[2] = data;
             break;
         case 0x82: // DMA channel 3 high addr
-            dma.highAddr[3] = data;
+            dma[0].highAddr[3] = data;
             break;
         case 0x83: // DMA channel 1 high addr
-            dma.highAddr[1] = data;
+            dma[0].highAddr[1] = data;
+            break;
+        case 0x89: // DMA channel 6 high addr
+            dma[1].highAddr[2] = data;
+            break;
+        case 0x8A: // DMA channel 7 high addr
+            dma[1].highAddr[3] = data;
+            break;
+        case 0x8B: // DMA channel 5 high addr
+            dma[1].highAddr[1] = data;
+            break;
+        case 0x8F: // DMA channel 4 high addr (refresh)
+            dma[1].highAddr[0] = data;
             break;
 
         case 0x92: // system control port A
+        {
             systemControlA = data;
 
             // bit 0/1 are also reset/a20
+            bool oldA20 = getA20();
             i8042OutputPort = (i8042OutputPort & ~3) | (data & 3);
 
+            if(getA20() != oldA20)
+                sys.setA20(getA20());
+
             break;
+        }
 
         case 0xA0: // second PIC ICW1, OCW 2/3
             pic[1].write(0, data);
             break;
         case 0xA1: // second PIC
         {
-            if(pic[1].nextInit == 0) // writing mask
-            {
-                auto enabled = pic[1].mask & ~data;
-
-                if(enabled)
-                {
-                    // sync devices that are getting their IRQ unmasked
-                    sys.updateForInterrupts(enabled, data);
-                }
-            }
-
             pic[1].write(1, data);
 
-            sys.calculateNextInterruptCycle(sys.getCycleCount());
             updateMaskedPICRequest();
 
             break;
         }
 
+        case 0xC0: // DMA channel 4 addr
+        case 0xC2: // DMA channel 4 word count
+        case 0xC4: // DMA channel 5 addr
+        case 0xC6: // DMA channel 5 word count
+        case 0xC8: // DMA channel 6 addr
+        case 0xCA: // DMA channel 6 word count
+        case 0xCC: // DMA channel 7 addr
+        case 0xCE: // DMA channel 7 word count
+        case 0xD0: // second DMA command
+        case 0xD2: // second DMA request
+        case 0xD4: // second DMA mask
+        case 0xD6: // second DMA mode
+        case 0xD8: // second DMA reset flip-flop
+        case 0xDA: // second DMA master clear
+            dma[1].write((addr - 0xC0) / 2, data);
+            break;
+
 #ifndef NDEBUG
         default:
             auto [cs, ip, opAddr] = sys.getCPU().getOpStartAddr();
@@ -511,36 +461,16 @@ void Chipset::write(uint16_t addr, uint8_t data)
     }
 }
 
-void Chipset::updateForInterrupts(uint8_t mask)
+void Chipset::handleEvent(int id)
 {
-    // timer
-    if(!(mask & 1))
-    {
-        auto passed = sys.getCycleCount() - pit.lastUpdateCycle;
-        if(passed >= pit.nextUpdateCycle - pit.lastUpdateCycle)
-            updatePIT();
-    }
+    if(id == Event_PIT)
+        updatePIT();
 }
 
-int Chipset::getCyclesToNextInterrupt(uint32_t cycleCount)
-{
-    int toUpdate = std::numeric_limits<int>::max();
-
-    // timer
-    if(!(pic[0].mask & 1))
-        toUpdate = std::min(toUpdate, static_cast<int>(pit.nextUpdateCycle - cycleCount));
-
-    // might be late for a PIT update sometimes
-    // usually hit this when recalculating because the PIC mask has changed
-    if(toUpdate < 0)
-        toUpdate = 0;
-
-    return toUpdate;
-}
-
-void Chipset::dmaWrite(int ch, uint8_t data)
+int Chipset::dmaWrite(int ch, const uint8_t *buf, int count)
 {
     dmaRequest(0, false);
+    return count;
 }
 
 void Chipset::updateForDisplay()
@@ -552,96 +482,159 @@ void Chipset::updateForDisplay()
 
 void Chipset::dmaRequest(int ch, bool active, IODevice *dev)
 {
+    auto &controller = dma[ch / 4];
+    ch &= 3;
+
     // disabled
-    if(dma.command & (1 << 2))
+    if(controller.command & (1 << 2))
         return;
 
     // if active is false, dev should be null
-    dma.requestedDev[ch] = dev;
+    controller.requestedDev[ch] = dev;
 
     // update requests
     if(active)
-        dma.request |= 1 << ch;
+        controller.request |= 1 << ch;
     else
-        dma.request &= ~(1 << ch);
+        controller.request &= ~(1 << ch);
 }
 
 uint16_t Chipset::getDMAWordCount(int ch)
 {
-    return dma.currentWordCount[ch];
+    return dma[ch / 4].currentWordCount[ch & 3];
 }
 
 void Chipset::updateDMA()
 {
-    // disabled
-    if(dma.command & (1 << 2))
-        return;
-
-    auto active = dma.request & ~(dma.mask);
-
-    // whoops, no channel 0
-    for(int i = 1; i < 4; i++)
+    for(auto &controller : dma)
     {
-        if(!(active & (1 << i)))
+        // disabled
+        if(controller.command & (1 << 2))
             continue;
 
-        int dir = (dma.mode[i] >> 2) & 3;
-        bool dec = dma.mode[i] & (1 << 5);
-
-        auto addr = (dma.highAddr[i] << 16) + dma.currentAddress[i];
+        // the second controller transfers words, addresses/counts are in words
+        // (and the page register bit 0 is ignored)
+        int wordShift = controller.firstChannel ? 1 : 0;
+        int wordSize = 1 << wordShift;
 
-        auto dev = dma.requestedDev[i];
-
-        switch(dir)
+        // whoops, no channel 0
+        // (and 4 is the cascade from the first controller)
+        for(int i = 1; i < 4; i++)
         {
-            case 0: // verify
-                break; // doesn't transfer anything
-            
-            case 1: // write
+            // transfer as much as we can in one go, devices drop their request if they need to wait
+            // (single, block and demand modes are all handled this way)
+            while(controller.request & ~controller.mask & (1 << i))
             {
-                uint8_t data = 0xFF;
-                if(dev)
-                    data = dev->dmaRead(i, dma.currentWordCount[i] == 0);
+                int ch = controller.firstChannel + i;
+                int dir = (controller.mode[i] >> 2) & 3;
+                bool dec = controller.mode[i] & (1 << 5);
 
-                sys.writeMem(addr, data);
-                break;
-            }
+                auto dev = controller.requestedDev[i];
 
-            case 2: // read
-                if(dev)
-                    dev->dmaWrite(i, sys.readMem(addr));
-                
-                break;
-        }
+                // limit to the end of the transfer, the 64k (words) the address wraps within and the memory page
+                // (all in bytes from here)
+                int remaining = (controller.currentWordCount[i] + 1) << wordShift;
+                int count = remaining;
 
-        // update count/addr
-        if(dec)
-            dma.currentAddress[i]--;
-        else
-            dma.currentAddress[i]++;
+                uint16_t addr16 = controller.currentAddress[i];
+                uint32_t addr = ((controller.highAddr[i] >> wordShift) << (16 + wordShift)) + (addr16 << wordShift);
+                int pageOffset = addr & (System::getMemoryBlockSize() - 1);
 
-        dma.currentWordCount[i]--;
+                if(dec)
+                    count = std::min({count, (addr16 + 1) << wordShift, pageOffset + wordSize});
+                else
+                    count = std::min({count, (0x10000 - addr16) << wordShift, System::getMemoryBlockSize() - pageOffset});
 
-        // rollover
-        if(dma.currentWordCount[i] == 0xFFFF)
-        {
-            // complete
-            dma.status |= 1 << i;
+                // words are still stored in order when decrementing
+                auto byteAddr = [&](int off)
+                {
+                    return dec ? addr - (off & ~(wordSize - 1)) + (off & (wordSize - 1)) : addr + off;
+                };
 
-            if(dev)
-                dev->dmaComplete(i);
+                // copy directly to/from memory if possible
+                uint8_t tmpBuf[64];
+                uint8_t *ptr = nullptr;
 
-            // auto-init
-            if(dma.mode[i] & (1 << 4))
-            {
-                dma.currentAddress[i] = dma.baseAddress[i];
-                dma.currentWordCount[i] = dma.baseWordCount[i];
+                if(!dec && (dir == 1 || dir == 2))
+                    ptr = sys.getDMAPtr(addr, count, dir == 1);
+
+                if(!ptr)
+                {
+                    count = std::min(count, int(sizeof(tmpBuf)));
+                    ptr = tmpBuf;
+
+                    if(dir == 2)
+                    {
+                        for(int j = 0; j < count; j++)
+                            tmpBuf[j] = sys.readMem(byteAddr(j));
+                    }
+                }
+
+                bool isLast = count == remaining;
+                int transferred = count;
+
+                switch(dir)
+                {
+                    case 1: // write
+                        if(dev)
+                            transferred = dev->dmaRead(ch, ptr, count, isLast);
+                        else
+                            memset(ptr, 0xFF, count);
+
+                        if(ptr == tmpBuf)
+                        {
+                            for(int j = 0; j < transferred; j++)
+                                sys.writeMem(byteAddr(j), tmpBuf[j]);
+                        }
+                        break;
+
+                    case 2: // read
+                        if(dev)
+                            transferred = dev->dmaWrite(ch, ptr, count);
+                        break;
+
+                    default: // verify, doesn't transfer anything
+                        break;
+                }
+
+                // partial words are dropped
+                int transfers = transferred >> wordShift;
+
+                // device isn't ready but didn't drop the request
+                if(transfers == 0)
+                    break;
+
+                // update count/addr
+                if(dec)
+                    controller.currentAddress[i] -= transfers;
+                else
+                    controller.currentAddress[i] += transfers;
+
+                controller.currentWordCount[i] -= transfers;
+
+                // rollover
+                if(controller.currentWordCount[i] == 0xFFFF)
+                {
+                    // complete
+                    controller.status |= 1 << i;
+
+                    if(dev)
+                        dev->dmaComplete(ch);
+
+                    // auto-init
+                    if(controller.mode[i] & (1 << 4))
+                    {
+                        controller.currentAddress[i] = controller.baseAddress[i];
+                        controller.currentWordCount[i] = controller.baseWordCount[i];
+
+                        // don't loop forever if the device never stops
+                        break;
+                    }
+                    else // set mask
+                        controller.mask |= (1 << i);
+                }
             }
-            else // set mask
-                dma.mask |= (1 << i);
         }
-
-        return;
     }
 }
 
@@ -850,6 +843,15 @@ void Chipset::setSpeakerAudioCallback(SpeakerAudioCallback cb)
     speakerCb = cb;
 }
 
+// sends any buffered samples now instead of waiting for a full block
+void Chipset::flushSpeakerAudio()
+{
+    if(speakerCb && speakerBufferCount)
+        speakerCb(speakerBuffer, speakerBufferCount);
+
+    speakerBufferCount = 0;
+}
+
 void Chipset::setFixedDiskPresent(int index, bool present)
 {
     if(index > 1)
@@ -865,13 +867,19 @@ void Chipset::setFixedDiskPresent(int index, bool present)
 void Chipset::setTotalMemory(uint32_t size)
 {
     // convert to kB, remove first MB
-    uint32_t extMemKB = size / 1024 - 1024;
+    uint32_t extMemKB = std::min(size / 1024 - 1024, 0xFFFFu);
 
     cmosRam[0x17] = extMemKB & 0xFF;
     cmosRam[0x18] = extMemKB >> 8;
 
     cmosRam[0x30] = extMemKB & 0xFF;
     cmosRam[0x31] = extMemKB >> 8;
+
+    // memory above 16M in 64k units (SeaBIOS reads this)
+    uint32_t highMem64K = size > (16 << 20) ? (size - (16 << 20)) >> 16 : 0;
+
+    cmosRam[0x34] = highMem64K & 0xFF;
+    cmosRam[0x35] = highMem64K >> 8;
 }
 
 void Chipset::setRTC(int seconds, int minutes, int hours, int days, int month, int year)
@@ -993,6 +1001,101 @@ void Chipset::updateRTC()
     }
 }
 
+uint8_t Chipset::DMA::read(int index)
+{
+    if(index < 8)
+    {
+        int channel = index / 2;
+        auto &reg = (index & 1) ? currentWordCount[channel] : currentAddress[channel];
+
+        uint8_t ret;
+        if(flipFlop)
+            ret = reg >> 8;
+        else
+            ret = reg & 0xFF;
+
+        flipFlop = !flipFlop;
+
+        return ret;
+    }
+
+    if(index == 8) // status
+        return status;
+
+    return 0xFF;
+}
+
+void Chipset::DMA::write(int index, uint8_t data)
+{
+    if(index < 8) // addr/word count
+    {
+        int channel = index / 2;
+        auto &base = (index & 1) ? baseWordCount[channel] : baseAddress[channel];
+        auto &current = (index & 1) ? currentWordCount[channel] : currentAddress[channel];
+
+        if(flipFlop)
+            current = base = (base & 0xFF) | data << 8;
+        else
+            base = (base & 0xFF00) | data;
+
+        flipFlop = !flipFlop;
+        return;
+    }
+
+    switch(index)
+    {
+        case 0x8: // command
+            command = data;
+            break;
+        case 0x9: // request
+        {
+            int channel = data & 3;
+            if(data & (1 << 2))
+                request |= 1 << channel;
+            else
+                request &= ~(1 << channel);
+            break;
+        }
+        case 0xA: // mask
+        {
+            int channel = data & 3;
+            if(data & (1 << 2))
+                mask |= 1 << channel;
+            else
+                mask &= ~(1 << channel);
+            break;
+        }
+        case 0xB: // mode
+        {
+            int channel = data & 3;
+            int dir = (data >> 2) & 3;
+            bool autoInit = data & (1 << 4);
+            bool dec = data & (1 << 5);
+            int mode = data >> 6;
+
+            static const char *dirStr[]{"verify", "write", "read", "ILLEGAL"};
+            static const char *modeStr[]{"demand", "single", "block", "cascade"};
+
+            if(mode != 1)
+                printf("DMA ch%i %s%s %s %s\n", firstChannel + channel, autoInit ? "auto-init ": "", modeStr[mode], dirStr[dir], dec ? "decrement" : "increment");
+
+            this->mode[channel] = data;
+            break;
+        }
+        case 0xC: // reset flip-flop
+            flipFlop = false;
+            break;
+
+        case 0xD: // master clear
+            command = 0;
+            status = 0;
+            request = 0;
+            flipFlop = false;
+            mask = 0xF;
+            break;
+    }
+}
+
 uint8_t Chipset::PIC::read(int index)
 {
     if(index == 0) // OCW3
@@ -1103,122 +1206,167 @@ void Chipset::updateMaskedPICRequest()
 
 void Chipset::updatePIT()
 {
-    auto elapsed = sys.getCycleCount() - pit.lastUpdateCycle;
+    uint32_t elapsed = (sys.getCycleCount() - pit.lastUpdateCycle) / System::getPITClockDiv();
 
-    elapsed /= System::getPITClockDiv();
+    if(!elapsed)
+        return;
 
-    while(elapsed)
+    if(pit.active & 1)
     {
-        int step = std::min(elapsed, (pit.nextUpdateCycle - pit.lastUpdateCycle) / System::getPITClockDiv());
+        if(advancePITChannel(0, elapsed))
+            flagPICInterrupt(0);
+    }
 
-        int reloaded = pit.reloadNextCycle;
-        pit.reloadNextCycle = 0;
+    // ch1 is refresh, not emulated
 
-        int active = pit.active;
+    // ch2 gate
+    if((pit.active & 4) && (systemControlB & 1))
+    {
+        // the speaker needs to see every change, but only while it's enabled
+        // (the number of steps here is limited by the tone frequency, not the elapsed time)
+        auto remaining = elapsed;
 
-        for(int i = 0; active; i++, active >>= 1)
+        if(systemControlB & 2)
         {
-            if(!(active & 1))
-                continue;
+            auto cycle = pit.lastUpdateCycle;
 
-            // ch2 gate
-            if(i == 2 && !(systemControlB & 1))
-                continue;
+            while(true)
+            {
+                auto toChange = getPITTicksToOutputChange(2);
+                if(!toChange || toChange > remaining)
+                    break;
 
-            int mode = (pit.control[i] >> 1) & 7;
+                cycle += toChange * System::getPITClockDiv();
+                updateSpeaker(cycle);
 
-            if(mode == 3) // mode 3 decrements twice
-                pit.counter[i] -= step * 2;
-            else if(reloaded & (1 << i)) // reload
-            {
-                assert(step == 1);
-                // reload after reaching 1 on the last cycle
-                pit.counter[i] = pit.reload[i];
-
-                // reloadNextCycle is only set for mode 2
-                // go high again
-                pit.outState |= (1 << i);
-                // and trigger interrupt/dma if needed
-                if(i == 0)
-                    flagPICInterrupt(0);
+                advancePITChannel(2, toChange);
+                remaining -= toChange;
             }
-            else
-                pit.counter[i] -= step;
+        }
 
-            if(mode == 0 && pit.counter[i] == 0 && !(pit.outState & (1 << i)))
-            {
-                if(i == 2)
-                    updateSpeaker(pit.lastUpdateCycle + step * System::getPITClockDiv());
+        advancePITChannel(2, remaining);
+    }
 
-                // go high
-                pit.outState |= 1 << i;
-            
-                // ch0 should trigger interrupt here
-                if(i == 0)
-                    flagPICInterrupt(0);
-            }
-            else if(mode == 2 && pit.counter[i] == 1)
-            {
-                pit.reloadNextCycle |= 1 << i;
-                pit.outState &= ~(1 << i);
-            }
-            else if(mode == 3 && pit.counter[i] == 0)
-            {
-                if(i == 2)
-                    updateSpeaker(pit.lastUpdateCycle + step * System::getPITClockDiv());
+    pit.lastUpdateCycle += elapsed * System::getPITClockDiv();
 
-                // toggle out and reload
-                // TODO: should delay low by one cycle if odd count
-                pit.outState ^= 1 << i;
-                pit.counter[i] = pit.reload[i] & ~1;
+    updatePITEvent();
+}
 
-                if(i == 0 && (pit.outState & 1))
-                    flagPICInterrupt(0);
-            }
+// steps a channel forwards, returns true if the output went high at any point
+bool Chipset::advancePITChannel(int channel, uint32_t ticks)
+{
+    int mode = (pit.control[channel] >> 1) & 7;
+    uint8_t bit = 1 << channel;
+
+    // 0 is 65536
+    uint32_t counter = pit.counter[channel] ? pit.counter[channel] : 0x10000;
+    uint32_t reload = pit.reload[channel] ? pit.reload[channel] : 0x10000;
+
+    bool rising = false;
+
+    if(mode == 0) // interrupt on terminal count
+    {
+        if(!(pit.outState & bit) && ticks >= counter)
+        {
+            // go high (and stay there)
+            pit.outState |= bit;
+            rising = true;
         }
 
-        pit.lastUpdateCycle += step * System::getPITClockDiv();
-        elapsed -= step;
+        // keeps counting
+        pit.counter[channel] -= ticks;
+    }
+    else if(mode == 2) // rate generator
+    {
+        // low for one cycle when reaching 1, then reload
+        if(ticks >= counter)
+        {
+            rising = true;
+            counter = reload - (ticks - counter) % reload;
+        }
+        else
+            counter -= ticks;
+
+        pit.counter[channel] = counter;
+
+        if(counter == 1)
+            pit.outState &= ~bit;
+        else
+            pit.outState |= bit;
+    }
+    else if(mode == 3) // square wave
+    {
+        // decrements twice, toggles out and reloads at 0
+        // TODO: should delay low by one cycle if odd count
+        uint32_t period = (reload & ~1) ? (reload & ~1) : 0x10000;
+        uint32_t halfPeriod = period / 2;
+        uint32_t toToggle = counter / 2;
+
+        if(ticks >= toToggle)
+        {
+            ticks -= toToggle;
+            uint32_t toggles = 1 + ticks / halfPeriod;
+
+            rising = toggles > 1 || !(pit.outState & bit);
+
+            if(toggles & 1)
+                pit.outState ^= bit;
 
-        // recalculate next
-        // shortcut if we know it's the next cycle
-        if(pit.reloadNextCycle)
-            pit.nextUpdateCycle = pit.lastUpdateCycle + System::getPITClockDiv();
-        else if(pit.lastUpdateCycle == pit.nextUpdateCycle || pit.reloadNextCycle)
-            calculateNextPITUpdate();
+            counter = period - (ticks % halfPeriod) * 2;
+        }
+        else
+            counter -= ticks * 2;
+
+        pit.counter[channel] = counter;
     }
+    else
+        pit.counter[channel] -= ticks;
+
+    return rising;
 }
 
-void Chipset::calculateNextPITUpdate()
+// 0 if the output isn't going to change
+uint32_t Chipset::getPITTicksToOutputChange(int channel)
 {
-    // find first channel to trigger
-    int step = 0xFFFF;
-    for(int i = 0; i < 3; i++)
-    {
-        if(!(pit.active & (1 << i)))
-            continue;
+    int mode = (pit.control[channel] >> 1) & 7;
+    uint32_t counter = pit.counter[channel] ? pit.counter[channel] : 0x10000;
 
-        // ch2 gate
-        if(i == 2 && !(systemControlB & 1))
-            continue;
+    if(mode == 0)
+        return (pit.outState & (1 << channel)) ? 0 : counter;
+    else if(mode == 2)
+        return counter > 1 ? counter - 1 : 1;
+    else if(mode == 3)
+        return counter / 2;
 
-        int mode = (pit.control[i] >> 1) & 7;
+    return 0;
+}
 
-        int remaining = pit.counter[i];
+// the PIT only needs to be updated on time if the interrupt is enabled
+void Chipset::updatePITEvent()
+{
+    uint32_t ticks = 0;
 
-        if(mode == 2 && remaining > 1)
-            remaining--; // count to 1
+    if((pit.active & 1) && !(pic[0].mask & 1))
+    {
+        // find the next rising edge
+        int mode = (pit.control[0] >> 1) & 7;
+        uint32_t counter = pit.counter[0] ? pit.counter[0] : 0x10000;
+
+        if(mode == 0 && !(pit.outState & 1))
+            ticks = counter;
+        else if(mode == 2)
+            ticks = counter;
         else if(mode == 3)
-            remaining /= 2; // double-decrement
-
-        if(remaining > 0)
         {
-            if(remaining < step)
-                step = remaining;
+            uint32_t reload = pit.reload[0] & ~1;
+            ticks = counter / 2 + ((pit.outState & 1) ? (reload ? reload / 2 : 0x8000) : 0);
         }
     }
 
-    pit.nextUpdateCycle = pit.lastUpdateCycle + step * System::getPITClockDiv();
+    if(ticks)
+        sys.scheduleEvent(this, Event_PIT, pit.lastUpdateCycle + ticks * System::getPITClockDiv());
+    else
+        sys.cancelEvent(this, Event_PIT);
 }
 
 void Chipset::updateSpeaker(uint32_t target)
@@ -1271,8 +1419,10 @@ void Chipset::updateSpeaker(uint32_t target)
         // if we're doing multiple samples the next one will either be fully on or off
         speakerValue = value ? divider : 0;
 
-        if(speakerCb)
-            speakerCb(sample);
+        speakerBuffer[speakerBufferCount++] = sample;
+
+        if(speakerBufferCount == speakerBufferSize)
+            flushSpeakerAudio();
     }
 
     // prepare for next
@@ -1333,9 +1483,15 @@ void Chipset::write8042ControllerData(uint8_t data)
             break;
 
         case 0xD1:
+        {
             printf("8042 output %02X\n", data);
+            bool oldA20 = getA20();
             i8042OutputPort = data;
+
+            if(getA20() != oldA20)
+                sys.setA20(getA20());
             break;
+        }
         case 0xD2: // first port echo
             i8042Queue.push(data);
             break;
@@ -1501,7 +1657,9 @@ void Chipset::update8042Interrupt()
 
 System::System() : chipset(*this), cpu(*this)
 {
-    addIODevice(0xFF00, 0, 1 << 0 | 1 << 1, &chipset);
+    addIODevice(0xFF00, 0, &chipset);
+    updateNextEventCycle();
+    setA20(chipset.getA20());
 }
 
 void System::reset()
@@ -1511,57 +1669,179 @@ void System::reset()
 
 void System::addMemory(uint32_t base, uint32_t size, uint8_t *ptr)
 {
-    assert(size % blockSize == 0);
-    assert(base % blockSize == 0);
-    assert(base + size <= maxAddress);
+    mapPages(base, size, ptr, 0);
+}
 
-    auto block = base / blockSize;
-    int numBlocks = size / blockSize;
+void System::addReadOnlyMemory(uint32_t base, uint32_t size, const uint8_t *ptr)
+{
+    mapPages(base, size, const_cast<uint8_t *>(ptr), MemPage_ReadOnly);
+}
 
-    for(int i = 0; i < numBlocks; i++)
-        memMap[block + i] = ptr ? ptr - base : nullptr;
+void System::removeMemory(uint32_t base, uint32_t size)
+{
+    mapPages(base, size, nullptr, 0);
 }
 
-void System::addReadOnlyMemory(uint32_t base, uint32_t size, const uint8_t *ptr)
+void System::setA20(bool enabled)
 {
-    assert(size % blockSize == 0);
-    assert(base % blockSize == 0);
-    assert(base + size <= maxAddress);
+    if(enabled == a20Enabled)
+        return;
 
-    auto block = base / blockSize;
-    int numBlocks = size / blockSize;
+    a20Enabled = enabled;
 
-    for(int i = 0; i < numBlocks; i++)
+    // only the part of the address space that real mode can reach is masked
+    auto hmaPage = hmaBase / pageSize;
+
+    for(int i = 0; i < numHMAPages; i++)
     {
-        memMap[block + i] = const_cast<uint8_t *>(ptr) - base;
+        if(enabled)
+        {
+            memMap[hmaPage + i] = hmaMap[i];
+            memPageFlags[hmaPage + i] = hmaPageFlags[i];
+        }
+        else
+        {
+            hmaMap[i] = memMap[hmaPage + i];
+            hmaPageFlags[i] = memPageFlags[hmaPage + i];
+
+            // reads from RAM can still go direct, everything else is redirected by the WithHandler functions
+            auto lowPtr = memMap[i];
+            memMap[hmaPage + i] = lowPtr && !memPageFlags[i] ? lowPtr - hmaBase : nullptr;
+            memPageFlags[hmaPage + i] = MemPage_A20Wrap;
+        }
     }
+
+    cpu.flushTLB();
 }
 
-void System::removeMemory(unsigned int block)
+// this started out entirely because EGA/VGA memory mapping is mad
+void System::setMemAccessHandler(uint32_t base, uint32_t size, const MemAccessHandler &handler)
 {
-    assert(block < maxAddress / blockSize);
-    memMap[block] = nullptr;
+    // clear the range first so that it won't count as using a handler
+    removeMemory(base, size);
+
+    auto sameHandler = [&handler](const MemAccessHandler &h)
+    {
+        return h.read == handler.read && h.read16 == handler.read16 && h.read32 == handler.read32
+            && h.write == handler.write && h.write16 == handler.write16 && h.write32 == handler.write32
+            && h.userData == handler.userData;
+    };
+
+    // find which handlers are still used
+    bool used[maxMemHandlers]{};
+
+    for(int i = 0; i < numPages; i++)
+        used[memPageFlags[i] & MemPage_HandlerMask] = true;
+
+    // the real HMA mapping is somewhere else while A20 is disabled
+    if(!a20Enabled)
+    {
+        for(auto flags : hmaPageFlags)
+            used[flags & MemPage_HandlerMask] = true;
+    }
+
+    int index = 0;
+
+    for(int i = 1; i < maxMemHandlers; i++)
+    {
+        if(used[i] && sameHandler(memHandlers[i]))
+        {
+            index = i;
+            break;
+        }
+    }
+
+    // new handler, find a free slot
+    if(!index)
+    {
+        for(int i = 1; i < maxMemHandlers; i++)
+        {
+            if(!used[i])
+            {
+                index = i;
+                memHandlers[i] = handler;
+                break;
+            }
+        }
+    }
+
+    assert(index);
+
+    mapPages(base, size, nullptr, index);
 }
 
-// this is entirely because EGA/VGA memory mapping is mad
-void System::setMemAccessCallbacks(uint32_t baseAddr, uint32_t size, MemReadCallback readCb, MemWriteCallback writeCb, void *userData)
+void System::mapPages(uint32_t base, uint32_t size, uint8_t *ptr, uint8_t flags)
 {
-    memAccessCbBase = baseAddr;
-    memAccessCbEnd = baseAddr + size;
-    memReadCb = readCb;
-    memWriteCb = writeCb;
-    memAccessUserData = userData;
+    assert(size % pageSize == 0);
+    assert(base % pageSize == 0);
+    assert(base + size <= maxAddress);
+
+    // update the real mapping, then redo the A20 masking in case either end of it changed
+    bool a20 = a20Enabled;
+    setA20(true);
+
+    auto page = base / pageSize;
+    int count = size / pageSize;
+
+    for(int i = 0; i < count; i++)
+    {
+        memMap[page + i] = ptr ? ptr - base : nullptr;
+        memPageFlags[page + i] = flags;
+    }
+
+    setA20(a20);
+
+    cpu.flushTLB();
 }
 
-void System::addIODevice(uint16_t mask, uint16_t value, uint8_t picMask, IODevice *dev)
+void System::addIODevice(uint16_t mask, uint16_t value, IODevice *dev)
 {
-    ioDevices.emplace_back(IORange{mask, value, picMask, dev});
+    ioDevices.emplace_back(IORange{mask, value, dev});
+    updateIOPortMap();
 }
 
 void System::removeIODevice(IODevice *dev)
 {
     auto it = std::remove_if(ioDevices.begin(), ioDevices.end(), [dev](auto &r){return r.dev == dev;});
     ioDevices.erase(it, ioDevices.end());
+    updateIOPortMap();
+}
+
+// rebuilds the port -> device lookup, first matching device wins
+void System::updateIOPortMap()
+{
+    ioPortTables.clear();
+
+    for(int page = 0; page < 256; page++)
+    {
+        std::unique_ptr<IODevice *[]> table(new IODevice *[256]);
+
+        for(int i = 0; i < 256; i++)
+        {
+            uint16_t addr = page << 8 | i;
+            table[i] = nullptr;
+
+            for(auto &dev : ioDevices)
+            {
+                if((addr & dev.ioMask) == dev.ioValue)
+                {
+                    table[i] = dev.dev;
+                    break;
+                }
+            }
+        }
+
+        // most devices don't decode the high bits, so the same tables repeat
+        auto it = std::find_if(ioPortTables.begin(), ioPortTables.end(), [&table](auto &t){return memcmp(t.get(), table.get(), sizeof(IODevice *) * 256) == 0;});
+
+        if(it == ioPortTables.end())
+        {
+            ioPortTables.emplace_back(std::move(table));
+            it = ioPortTables.end() - 1;
+        }
+
+        ioPortMap[page] = it->get();
+    }
 }
 
 
@@ -1570,21 +1850,13 @@ uint8_t RAM_FUNC(System::readMem)(uint32_t addr)
     if(addr >= maxAddress)
         return 0xFF;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
-
-    auto block = addr / blockSize;
-    
-    auto ptr = memMap[block];
+    auto ptr = memMap[addr / pageSize];
 
     if(ptr)
         return ptr[addr];
 
     // final attempt for complicated mappings
-    if(memReadCb && addr >= memAccessCbBase && addr < memAccessCbEnd)
-        return memReadCb(addr, memAccessUserData);
-
-    return 0xFF;
+    return readMemWithHandler(addr);
 }
 
 uint16_t RAM_FUNC(System::readMem16)(uint32_t addr)
@@ -1592,18 +1864,13 @@ uint16_t RAM_FUNC(System::readMem16)(uint32_t addr)
     if(addr >= maxAddress)
         return 0xFFFF;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
-
-    auto block = addr / blockSize;
-
-    auto ptr = memMap[block];
+    // accesses crossing a page are split by the CPU
+    auto ptr = memMap[addr / pageSize];
 
     if(ptr)
         return *reinterpret_cast<uint16_t *>(ptr + addr);
 
-    // final attempt for complicated mappings
-    return readMem16WithCallback(addr);
+    return readMem16WithHandler(addr);
 }
 
 uint32_t RAM_FUNC(System::readMem32)(uint32_t addr)
@@ -1611,19 +1878,12 @@ uint32_t RAM_FUNC(System::readMem32)(uint32_t addr)
     if(addr >= maxAddress)
         return 0xFFFFFFFF;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
-
-    // this should work fine so long as nobody tries to read past the end of the block before A0000...
-    auto block = addr / blockSize;
-
-    auto ptr = memMap[block];
+    auto ptr = memMap[addr / pageSize];
 
     if(ptr)
         return *reinterpret_cast<uint32_t *>(ptr + addr);
 
-    // final attempt for complicated mappings
-    return readMem32WithCallback(addr);
+    return readMem32WithHandler(addr);
 }
 
 void RAM_FUNC(System::writeMem)(uint32_t addr, uint8_t data)
@@ -1631,21 +1891,19 @@ void RAM_FUNC(System::writeMem)(uint32_t addr, uint8_t data)
     if(addr >= maxAddress)
         return;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
-
-    auto block = addr / blockSize;
+    if(auto watch = pageWatch[addr >> 12])
+        cpu.watchedPageWrite(addr, 1, watch);
 
-    auto ptr = memMap[block];
+    auto page = addr / pageSize;
+    auto ptr = memMap[page];
 
-    if(ptr)
+    if(ptr && !memPageFlags[page])
     {
         ptr[addr] = data;
         return;
     }
 
-    if(memWriteCb && addr >= memAccessCbBase && addr < memAccessCbEnd)
-        memWriteCb(addr, data, memAccessUserData);
+    writeMemWithHandler(addr, data);
 }
 
 void RAM_FUNC(System::writeMem16)(uint32_t addr, uint16_t data)
@@ -1653,24 +1911,23 @@ void RAM_FUNC(System::writeMem16)(uint32_t addr, uint16_t data)
     if(addr >= maxAddress)
         return;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
-
-    auto block = addr / blockSize;
+    if(auto watch = pageWatch[addr >> 12])
+        cpu.watchedPageWrite(addr, 2, watch);
 
-    auto ptr = memMap[block];
+    auto page = addr / pageSize;
+    auto ptr = memMap[page];
 
     // HACK: prevent setting coprocessor bit in equipment flags
     if(addr == 0x410)
         data &= ~2;
 
-    if(ptr)
+    if(ptr && !memPageFlags[page])
     {
         *reinterpret_cast<uint16_t *>(ptr + addr) = data;
         return;
     }
 
-    return writeMem16WithCallback(addr, data);
+    writeMem16WithHandler(addr, data);
 }
 
 void RAM_FUNC(System::writeMem32)(uint32_t addr, uint32_t data)
@@ -1678,79 +1935,190 @@ void RAM_FUNC(System::writeMem32)(uint32_t addr, uint32_t data)
     if(addr >= maxAddress)
         return;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
-
-    auto block = addr / blockSize;
+    if(auto watch = pageWatch[addr >> 12])
+        cpu.watchedPageWrite(addr, 4, watch);
 
-    auto ptr = memMap[block];
+    auto page = addr / pageSize;
+    auto ptr = memMap[page];
 
-    if(ptr)
+    if(ptr && !memPageFlags[page])
     {
         *reinterpret_cast<uint32_t *>(ptr + addr) = data;
         return;
     }
 
-    return writeMem32WithCallback(addr, data);
+    writeMem32WithHandler(addr, data);
 }
 
 // these are split to a separate function to optimise the significantly more common case of accessing regular memory
+// (read-only pages also end up in the write ones, which do nothing, and so does everything in the HMA with A20 disabled)
+[[gnu::noinline]]
+uint8_t RAM_FUNC(System::readMemWithHandler)(uint32_t addr)
+{
+    // A20 disabled, redo the access in the first megabyte
+    if(memPageFlags[addr / pageSize] & MemPage_A20Wrap)
+        return readMem(addr & ~(1 << 20));
+
+    auto &handler = memHandlers[memPageFlags[addr / pageSize] & MemPage_HandlerMask];
+
+    if(handler.read)
+        return handler.read(addr, handler.userData);
+
+    return 0xFF;
+}
+
 [[gnu::noinline]]
-uint16_t RAM_FUNC(System::readMem16WithCallback)(uint32_t addr)
+uint16_t RAM_FUNC(System::readMem16WithHandler)(uint32_t addr)
 {
-    if(memReadCb && addr >= memAccessCbBase && addr < memAccessCbEnd)
+    // A20 disabled, redo the access in the first megabyte
+    if(memPageFlags[addr / pageSize] & MemPage_A20Wrap)
+        return readMem16(addr & ~(1 << 20));
+
+    auto &handler = memHandlers[memPageFlags[addr / pageSize] & MemPage_HandlerMask];
+
+    if(handler.read16)
+        return handler.read16(addr, handler.userData);
+
+    if(handler.read)
     {
-        return memReadCb(addr + 0, memAccessUserData)      |
-               memReadCb(addr + 1, memAccessUserData) << 8;
+        return handler.read(addr + 0, handler.userData)      |
+               handler.read(addr + 1, handler.userData) << 8;
     }
     return 0xFFFF;
 }
 
 [[gnu::noinline]]
-uint32_t RAM_FUNC(System::readMem32WithCallback)(uint32_t addr)
+uint32_t RAM_FUNC(System::readMem32WithHandler)(uint32_t addr)
 {
-    if(memReadCb && addr >= memAccessCbBase && addr < memAccessCbEnd)
+    // A20 disabled, redo the access in the first megabyte
+    if(memPageFlags[addr / pageSize] & MemPage_A20Wrap)
+        return readMem32(addr & ~(1 << 20));
+
+    auto &handler = memHandlers[memPageFlags[addr / pageSize] & MemPage_HandlerMask];
+
+    if(handler.read32)
+        return handler.read32(addr, handler.userData);
+
+    if(handler.read16)
     {
-        return memReadCb(addr + 0, memAccessUserData)       |
-               memReadCb(addr + 1, memAccessUserData) << 8  |
-               memReadCb(addr + 2, memAccessUserData) << 16 |
-               memReadCb(addr + 3, memAccessUserData) << 24;
+        return handler.read16(addr + 0, handler.userData) |
+               handler.read16(addr + 2, handler.userData) << 16;
+    }
+
+    if(handler.read)
+    {
+        return handler.read(addr + 0, handler.userData)       |
+               handler.read(addr + 1, handler.userData) << 8  |
+               handler.read(addr + 2, handler.userData) << 16 |
+               handler.read(addr + 3, handler.userData) << 24;
     }
     return 0xFFFFFFFF;
 }
 
 [[gnu::noinline]]
-void RAM_FUNC(System::writeMem16WithCallback)(uint32_t addr, uint16_t data)
+void RAM_FUNC(System::writeMemWithHandler)(uint32_t addr, uint8_t data)
+{
+    // A20 disabled, redo the access in the first megabyte (so that watches work)
+    if(memPageFlags[addr / pageSize] & MemPage_A20Wrap)
+        return writeMem(addr & ~(1 << 20), data);
+
+    auto &handler = memHandlers[memPageFlags[addr / pageSize] & MemPage_HandlerMask];
+
+    if(handler.write)
+        handler.write(addr, data, handler.userData);
+}
+
+[[gnu::noinline]]
+void RAM_FUNC(System::writeMem16WithHandler)(uint32_t addr, uint16_t data)
 {
-    if(memWriteCb && addr >= memAccessCbBase && addr < memAccessCbEnd)
+    // A20 disabled, redo the access in the first megabyte (so that watches work)
+    if(memPageFlags[addr / pageSize] & MemPage_A20Wrap)
+        return writeMem16(addr & ~(1 << 20), data);
+
+    auto &handler = memHandlers[memPageFlags[addr / pageSize] & MemPage_HandlerMask];
+
+    if(handler.write16)
+        handler.write16(addr, data, handler.userData);
+    else if(handler.write)
     {
-        memWriteCb(addr + 0, data      , memAccessUserData);
-        memWriteCb(addr + 1, data >>  8, memAccessUserData);
+        handler.write(addr + 0, data      , handler.userData);
+        handler.write(addr + 1, data >>  8, handler.userData);
     }
 }
 
 [[gnu::noinline]]
-void RAM_FUNC(System::writeMem32WithCallback)(uint32_t addr, uint32_t data)
+void RAM_FUNC(System::writeMem32WithHandler)(uint32_t addr, uint32_t data)
 {
-    if(memWriteCb && addr >= memAccessCbBase && addr < memAccessCbEnd)
+    // A20 disabled, redo the access in the first megabyte (so that watches work)
+    if(memPageFlags[addr / pageSize] & MemPage_A20Wrap)
+        return writeMem32(addr & ~(1 << 20), data);
+
+    auto &handler = memHandlers[memPageFlags[addr / pageSize] & MemPage_HandlerMask];
+
+    if(handler.write32)
+        handler.write32(addr, data, handler.userData);
+    else if(handler.write16)
     {
-        memWriteCb(addr + 0, data      , memAccessUserData);
-        memWriteCb(addr + 1, data >>  8, memAccessUserData);
-        memWriteCb(addr + 2, data >> 16, memAccessUserData);
-        memWriteCb(addr + 3, data >> 24, memAccessUserData);
+        handler.write16(addr + 0, data      , handler.userData);
+        handler.write16(addr + 2, data >> 16, handler.userData);
+    }
+    else if(handler.write)
+    {
+        handler.write(addr + 0, data      , handler.userData);
+        handler.write(addr + 1, data >>  8, handler.userData);
+        handler.write(addr + 2, data >> 16, handler.userData);
+        handler.write(addr + 3, data >> 24, handler.userData);
     }
 }
 
-const uint8_t *RAM_FUNC(System::mapAddress)(uint32_t addr) const
+uint8_t *System::getDirectAccessPtr(uint32_t addr, bool forWrite)
 {
     if(addr >= maxAddress)
         return nullptr;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
+    auto page = addr / pageSize;
 
-    auto block = addr / blockSize;
-    auto ptr = memMap[block];
+    // watched pages need to see writes
+    // and page 0 has the equipment flags hack in writeMem16
+    if(forWrite && (pageWatch[page] || memPageFlags[page] || addr < 0x1000))
+        return nullptr;
+
+    auto ptr = memMap[page];
+
+    if(ptr)
+        return ptr + addr;
+
+    return nullptr;
+}
+
+uint8_t *System::getDMAPtr(uint32_t addr, int len, bool forWrite)
+{
+    if(addr >= maxAddress)
+        return nullptr;
+
+    auto page = addr / pageSize;
+
+    // handlers/read-only/A20 wrapping
+    if(forWrite && memPageFlags[page])
+        return nullptr;
+
+    auto ptr = memMap[page];
+
+    if(!ptr)
+        return nullptr;
+
+    if(forWrite && pageWatch[page])
+        cpu.watchedPageWrite(addr, len, pageWatch[page]);
+
+    return ptr + addr;
+}
+
+const uint8_t *RAM_FUNC(System::mapAddress)(uint32_t addr) const
+{
+    if(addr >= maxAddress)
+        return nullptr;
+
+    auto ptr = memMap[addr / pageSize];
 
     if(ptr)
         return ptr + addr;
@@ -1760,11 +2128,8 @@ const uint8_t *RAM_FUNC(System::mapAddress)(uint32_t addr) const
 
 uint8_t RAM_FUNC(System::readIOPort)(uint16_t addr)
 {
-    for(auto & dev : ioDevices)
-    {
-        if((addr & dev.ioMask) == dev.ioValue)
-            return dev.dev->read(addr);
-    }
+    if(auto dev = getIODevice(addr))
+        return dev->read(addr);
 
 #ifndef NDEBUG
     if(addr >= 0xCF8 && addr < 0xD00) // PCI
@@ -1784,11 +2149,8 @@ uint8_t RAM_FUNC(System::readIOPort)(uint16_t addr)
 
 uint16_t RAM_FUNC(System::readIOPort16)(uint16_t addr)
 {
-    for(auto & dev : ioDevices)
-    {
-        if((addr & dev.ioMask) == dev.ioValue)
-            return dev.dev->read16(addr);
-    }
+    if(auto dev = getIODevice(addr))
+        return dev->read16(addr);
 
 #ifndef NDEBUG
     if(addr >= 0xCF8 && addr < 0xD00) // PCI
@@ -1801,13 +2163,26 @@ uint16_t RAM_FUNC(System::readIOPort16)(uint16_t addr)
     return 0xFFFF;
 }
 
+uint32_t RAM_FUNC(System::readIOPort32)(uint16_t addr)
+{
+    if(auto dev = getIODevice(addr))
+        return dev->read32(addr);
+
+#ifndef NDEBUG
+    if(addr >= 0xCF8 && addr < 0xD00) // PCI
+        return 0xFFFFFFFF;
+
+    auto [cs, ip, opAddr] = cpu.getOpStartAddr();
+    printf("IO R32 %04X @%08X\n", addr, opAddr);
+#endif
+
+    return 0xFFFFFFFF;
+}
+
 void RAM_FUNC(System::writeIOPort)(uint16_t addr, uint8_t data)
 {
-    for(auto & dev : ioDevices)
-    {
-        if((addr & dev.ioMask) == dev.ioValue)
-            return dev.dev->write(addr, data);
-    }
+    if(auto dev = getIODevice(addr))
+        return dev->write(addr, data);
 
     if(addr == 0xCF9 && data == 6) // PCI reboot (seabios uses this to reboot)
     {
@@ -1832,11 +2207,8 @@ void RAM_FUNC(System::writeIOPort)(uint16_t addr, uint8_t data)
 
 void RAM_FUNC(System::writeIOPort16)(uint16_t addr, uint16_t data)
 {
-    for(auto & dev : ioDevices)
-    {
-        if((addr & dev.ioMask) == dev.ioValue)
-            return dev.dev->write16(addr, data);
-    }
+    if(auto dev = getIODevice(addr))
+        return dev->write16(addr, data);
 
 #ifndef NDEBUG
     if(addr >= 0xCF8 && addr < 0xD00) // PCI
@@ -1847,39 +2219,93 @@ void RAM_FUNC(System::writeIOPort16)(uint16_t addr, uint16_t data)
 #endif
 }
 
-void System::updateForInterrupts()
+void RAM_FUNC(System::writeIOPort32)(uint16_t addr, uint32_t data)
 {
-    auto mask = chipset.getPICMask();
-    for(auto &dev : ioDevices)
-    {
-        if((dev.picMask & ~mask))
-            dev.dev->updateForInterrupts(mask);
-    }
+    if(auto dev = getIODevice(addr))
+        return dev->write32(addr, data);
+
+#ifndef NDEBUG
+    if(addr >= 0xCF8 && addr < 0xD00) // PCI
+        return;
+
+    auto [cs, ip, opAddr] = cpu.getOpStartAddr();
+    printf("IO W32 %04X = %08X @%08X\n", addr, data, opAddr);
+#endif
+}
+
+int System::readIOPortBlock(uint16_t addr, uint8_t *buf, int count, int wordSize)
+{
+    if(auto dev = getIODevice(addr))
+        return dev->readBlock(addr, buf, count, wordSize);
 
-    calculateNextInterruptCycle(getCycleCount());
+    return 0;
 }
 
-void System::updateForInterrupts(uint8_t updateMask, uint8_t picMask)
+int System::writeIOPortBlock(uint16_t addr, const uint8_t *buf, int count, int wordSize)
 {
-    for(auto &dev : ioDevices)
+    if(auto dev = getIODevice(addr))
+        return dev->writeBlock(addr, buf, count, wordSize);
+
+    return 0;
+}
+
+void System::scheduleEvent(IODevice *dev, int id, uint32_t cycle)
+{
+    auto it = std::find_if(events.begin(), events.end(), [dev, id](auto &e){return e.dev == dev && e.id == id;});
+
+    if(it != events.end())
     {
-        if(dev.picMask & updateMask)
-            dev.dev->updateForInterrupts(picMask);
+        // usually only moving the next event further away
+        it->cycle = cycle;
+        std::make_heap(events.begin(), events.end(), eventAfter);
     }
+    else
+    {
+        events.push_back({cycle, dev, id});
+        std::push_heap(events.begin(), events.end(), eventAfter);
+    }
+
+    updateNextEventCycle();
+}
+
+void System::cancelEvent(IODevice *dev, int id)
+{
+    auto it = std::find_if(events.begin(), events.end(), [dev, id](auto &e){return e.dev == dev && e.id == id;});
+
+    if(it == events.end())
+        return;
+
+    events.erase(it);
+    std::make_heap(events.begin(), events.end(), eventAfter);
+
+    updateNextEventCycle();
 }
 
-void System::calculateNextInterruptCycle(uint32_t cycleCount)
+void System::runEvents()
 {
-    int toUpdate = std::numeric_limits<int>::max();
+    auto cycleCount = getCycleCount();
 
-    auto mask = chipset.getPICMask();
-    for(auto &dev : ioDevices)
+    while(!events.empty() && static_cast<int>(events.front().cycle - cycleCount) <= 0)
     {
-        if((dev.picMask & ~mask))
-            toUpdate = std::min(toUpdate, dev.dev->getCyclesToNextInterrupt(cycleCount));
+        std::pop_heap(events.begin(), events.end(), eventAfter);
+        auto event = events.back();
+        events.pop_back();
+
+        // this may schedule another event
+        event.dev->handleEvent(event.id);
     }
 
-    assert(toUpdate >= 0 || nextInterruptCycle == cycleCount + toUpdate);
+    updateNextEventCycle();
+}
 
-    nextInterruptCycle = cycleCount + toUpdate;
+void System::updateNextEventCycle()
+{
+    auto cycleCount = getCycleCount();
+
+    if(events.empty())
+        nextEventCycle = cycleCount + std::numeric_limits<int>::max();
+    else if(static_cast<int>(events.front().cycle - cycleCount) < 0)
+        nextEventCycle = cycleCount; // late
+    else
+        nextEventCycle = events.front().cycle;
 }
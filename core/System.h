@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <functional>
 #include <list>
+#include <memory>
 
 #include "CPU.h"
 #include "FIFO.h"
@@ -19,37 +20,56 @@ class IODevice
 public:
     virtual uint8_t read(uint16_t addr) = 0;
     virtual uint16_t read16(uint16_t addr) = 0;
+    virtual uint32_t read32(uint16_t addr) = 0;
 
     virtual void write(uint16_t addr, uint8_t data) = 0;
     virtual void write16(uint16_t addr, uint16_t data) = 0;
+    virtual void write32(uint16_t addr, uint32_t data) = 0;
 
-    virtual void updateForInterrupts(uint8_t mask) = 0;
-    virtual int getCyclesToNextInterrupt(uint32_t cycleCount) = 0;
+    // optional block transfers for REP INS/OUTS, return the number of elements transferred
+    // (which may be less than count, 0 if not supported for this port)
+    virtual int readBlock(uint16_t addr, uint8_t *buf, int count, int wordSize) {return 0;}
+    virtual int writeBlock(uint16_t addr, const uint8_t *buf, int count, int wordSize) {return 0;}
+
+    // called when an event scheduled with System::scheduleEvent is reached
+    virtual void handleEvent(int id) {}
+
+    // if reads from this port can change without an interrupt (counters, retrace status...)
+    // a loop polling it won't be treated as idle
+    virtual bool readChangesWithTime(uint16_t addr) {return false;}
 
     // these are reversed from the DMA controller's perspective...
-    virtual uint8_t dmaRead(int ch, bool isLast) = 0;
-    virtual void dmaWrite(int ch, uint8_t data) = 0;
+    // transfer up to count bytes, return the number transferred (drop the request to stop early)
+    // channels 4-7 transfer words, count is still in bytes but partial words are ignored
+    // isLast is set if the transfer ends with the last byte of buf
+    virtual int dmaRead(int ch, uint8_t *buf, int count, bool isLast) = 0;
+    virtual int dmaWrite(int ch, const uint8_t *buf, int count) = 0;
     virtual void dmaComplete(int ch) = 0;
 };
 
 class Chipset final : public IODevice
 {
 public:
-    using SpeakerAudioCallback = void(*)(int8_t sample);
+    // called with blocks of 44.1kHz samples
+    using SpeakerAudioCallback = void(*)(const int8_t *samples, int count);
 
     Chipset(System &sys);
 
     uint8_t read(uint16_t addr) override;
     uint16_t read16(uint16_t addr) override {return read(addr) | read(addr + 1) << 8;}
+    uint32_t read32(uint16_t addr) override {return read16(addr) | read16(addr + 2) << 16;}
 
     void write(uint16_t addr, uint8_t data) override;
     void write16(uint16_t addr, uint16_t data) override {write(addr, data); write(addr + 1, data >> 8);}
+    void write32(uint16_t addr, uint32_t data) override {write16(addr, data); write16(addr + 2, data >> 16);}
 
-    void updateForInterrupts(uint8_t mask) override;
-    int getCyclesToNextInterrupt(uint32_t cycleCount) override;
+    void handleEvent(int id) override;
 
-    uint8_t dmaRead(int ch, bool isLast) override {return 0xFF;}
-    void dmaWrite(int ch, uint8_t data) override;
+    // PIT counters and the ch2 output bit
+    bool readChangesWithTime(uint16_t addr) override {return (addr >= 0x40 && addr <= 0x42) || addr == 0x61;}
+
+    int dmaRead(int ch, uint8_t *buf, int count, bool isLast) override {return 0;}
+    int dmaWrite(int ch, const uint8_t *buf, int count) override;
     void dmaComplete(int ch) override {}
 
     void updateForDisplay();
@@ -58,7 +78,7 @@ public:
     void dmaRequest(int ch, bool active, IODevice *dev = nullptr);
     uint16_t getDMAWordCount(int ch);
     void updateDMA();
-    bool needDMAUpdate() const {return dma.request & ~dma.mask;}
+    bool needDMAUpdate() const {return (dma[0].request & ~dma[0].mask) | (dma[1].request & ~dma[1].mask);}
 
     // PIC access/helpers
     bool hasInterrupt() const {return maskedPICRequest;}
@@ -80,6 +100,7 @@ public:
 
     // PIT/speaker
     void setSpeakerAudioCallback(SpeakerAudioCallback cb);
+    void flushSpeakerAudio();
 
     // misc
     void setFixedDiskPresent(int index, bool present);
@@ -91,6 +112,9 @@ public:
 private:
     struct DMA
     {
+        uint8_t read(int index);
+        void write(int index, uint8_t data);
+
         uint16_t baseAddress[4];
         uint16_t baseWordCount[4];
         uint16_t currentAddress[4];
@@ -109,6 +133,8 @@ private:
         uint8_t highAddr[4];
 
         IODevice *requestedDev[4];
+
+        int firstChannel; // 0 or 4 (16-bit)
     };
 
     struct PIC
@@ -141,16 +167,22 @@ private:
         uint8_t highByte = 0; // lo/hi access mode
 
         uint8_t outState = 0;
-        uint8_t reloadNextCycle = 0;
 
         uint32_t lastUpdateCycle = 0;
-        uint32_t nextUpdateCycle = 0;
     };
 
     void updateMaskedPICRequest();
 
+    enum TimedEvent
+    {
+        Event_PIT = 0,
+    };
+
+    // counters are calculated from lastUpdateCycle when needed
     void updatePIT();
-    void calculateNextPITUpdate();
+    bool advancePITChannel(int channel, uint32_t ticks);
+    uint32_t getPITTicksToOutputChange(int channel);
+    void updatePITEvent();
     void updateSpeaker(uint32_t target);
 
     void write8042ControllerCommand(uint8_t data);
@@ -165,7 +197,7 @@ private:
 
     System &sys;
 
-    DMA dma;
+    DMA dma[2];
 
     PIC pic[2];
 
@@ -194,13 +226,44 @@ private:
     uint32_t speakerSampleTimer = 0;
     unsigned speakerValue = 0;
     SpeakerAudioCallback speakerCb = nullptr;
+
+    // ~5.8ms
+    static constexpr int speakerBufferSize = 256;
+    int8_t speakerBuffer[speakerBufferSize];
+    int speakerBufferCount = 0;
 };
 
 class System
 {
 public:
     using MemReadCallback = uint8_t(*)(uint32_t addr, void *);
+    using MemRead16Callback = uint16_t(*)(uint32_t addr, void *);
+    using MemRead32Callback = uint32_t(*)(uint32_t addr, void *);
     using MemWriteCallback = void(*)(uint32_t addr, uint8_t data, void *);
+    using MemWrite16Callback = void(*)(uint32_t addr, uint16_t data, void *);
+    using MemWrite32Callback = void(*)(uint32_t addr, uint32_t data, void *);
+
+    // callbacks for memory mapped devices
+    // the 16/32-bit ones are optional, accesses are split into bytes if they're missing
+    struct MemAccessHandler
+    {
+        MemReadCallback read = nullptr;
+        MemRead16Callback read16 = nullptr;
+        MemRead32Callback read32 = nullptr;
+
+        MemWriteCallback write = nullptr;
+        MemWrite16Callback write16 = nullptr;
+        MemWrite32Callback write32 = nullptr;
+
+        void *userData = nullptr;
+    };
+
+    enum PageWatchFlags
+    {
+        PageWatch_Code = 1 << 0, // has decoded instructions cached
+        PageWatch_JIT  = 1 << 1, // has compiled code
+        PageWatch_PageTable = 1 << 2, // has page directory/table entries in the TLB
+    };
 
     System();
     void reset();
@@ -216,16 +279,27 @@ public:
 #endif
     }
 
+    // base and size need to be page aligned
     void addMemory(uint32_t base, uint32_t size, uint8_t *ptr);
     void addReadOnlyMemory(uint32_t base, uint32_t size, const uint8_t *ptr);
 
-    void removeMemory(unsigned int block);
+    void removeMemory(uint32_t base, uint32_t size);
+
+    // called by the chipset, masks the HMA back to the first 64K when disabled
+    void setA20(bool enabled);
+
+    // the address an access actually ends up at, which is only different in the HMA with A20 disabled
+    uint32_t getA20Address(uint32_t addr) const
+    {
+        return !a20Enabled && addr - hmaBase < uint32_t(numHMAPages * pageSize) ? addr - hmaBase : addr;
+    }
 
-    void setMemAccessCallbacks(uint32_t baseAddr, uint32_t size, MemReadCallback readCb, MemWriteCallback writeCb, void *userData = nullptr);
+    // the handler is copied, mapping over a range removes anything that was there before
+    void setMemAccessHandler(uint32_t base, uint32_t size, const MemAccessHandler &handler);
 
     Chipset &getChipset() {return chipset;}
 
-    void addIODevice(uint16_t mask, uint16_t value, uint8_t picMask, IODevice *dev);
+    void addIODevice(uint16_t mask, uint16_t value, IODevice *dev);
     void removeIODevice(IODevice *dev);
 
     uint8_t readMem(uint32_t addr);
@@ -235,17 +309,49 @@ public:
     void writeMem16(uint32_t addr, uint16_t data);
     void writeMem32(uint32_t addr, uint32_t data);
 
-    uint16_t readMem16WithCallback(uint32_t addr);
-    uint32_t readMem32WithCallback(uint32_t addr);
-    void writeMem16WithCallback(uint32_t addr, uint16_t data);
-    void writeMem32WithCallback(uint32_t addr, uint32_t data);
+    uint8_t readMemWithHandler(uint32_t addr);
+    uint16_t readMem16WithHandler(uint32_t addr);
+    uint32_t readMem32WithHandler(uint32_t addr);
+    void writeMemWithHandler(uint32_t addr, uint8_t data);
+    void writeMem16WithHandler(uint32_t addr, uint16_t data);
+    void writeMem32WithHandler(uint32_t addr, uint32_t data);
 
     const uint8_t *mapAddress(uint32_t addr) const;
 
+    // for the CPU's TLB, returns nullptr if accesses to the page have to go through read/writeMem
+    uint8_t *getDirectAccessPtr(uint32_t addr, bool forWrite);
+
+    // for DMA, len bytes from addr must be in the same page
+    // returns nullptr if the access has to go through read/writeMem, writes are reported to any page watch
+    uint8_t *getDMAPtr(uint32_t addr, int len, bool forWrite);
+
+    // writes to watched pages are reported to the CPU
+    void addPageWatch(uint32_t addr, uint8_t flags)
+    {
+        // make sure writes stop bypassing the watch
+        if(!pageWatch[addr >> 12])
+            cpu.disableTLBDirectWrites(addr);
+
+        pageWatch[addr >> 12] |= flags;
+    }
+    void removePageWatch(uint32_t addr, uint8_t flags) {pageWatch[addr >> 12] &= ~flags;}
+    uint8_t getPageWatch(uint32_t addr) const {return pageWatch[addr >> 12];}
+
     uint8_t readIOPort(uint16_t addr);
     uint16_t readIOPort16(uint16_t addr);
+    uint32_t readIOPort32(uint16_t addr);
     void writeIOPort(uint16_t addr, uint8_t data);
     void writeIOPort16(uint16_t addr, uint16_t data);
+    void writeIOPort32(uint16_t addr, uint32_t data);
+
+    int readIOPortBlock(uint16_t addr, uint8_t *buf, int count, int wordSize);
+    int writeIOPortBlock(uint16_t addr, const uint8_t *buf, int count, int wordSize);
+
+    bool ioPortReadChangesWithTime(uint16_t addr) const
+    {
+        auto dev = getIODevice(addr);
+        return dev && dev->readChangesWithTime(addr);
+    }
 
     void addCPUCycles(int cycles)
     {
@@ -254,27 +360,55 @@ public:
 #endif
     }
 
-    void updateForInterrupts();
-    void updateForInterrupts(uint8_t updateMask, uint8_t picMask);
+    // in system clock cycles, doesn't do anything with a hardware timer
+    void addSystemCycles(uint32_t cycles)
+    {
+#ifndef USE_PORT_TIMER
+        cycleCount += cycles;
+#endif
+    }
+
+    // device events, replaces any existing event with the same device/id
+    // (cycle is expected to be less than ~2^31 cycles away)
+    void scheduleEvent(IODevice *dev, int id, uint32_t cycle);
+    void cancelEvent(IODevice *dev, int id);
 
-    void calculateNextInterruptCycle(uint32_t cycleCount);
-    uint32_t getNextInterruptCycle() const {return nextInterruptCycle;}
+    // runs any events that are due
+    void runEvents();
+    uint32_t getNextEventCycle() const {return nextEventCycle;}
 
     static constexpr int getClockSpeed() {return systemClock;}
     static constexpr int getCPUClockSpeed() {return systemClock / cpuClkDiv;}
     static constexpr int getPITClockDiv() {return pitClkDiv;}
 
-    static constexpr int getMemoryBlockSize() {return blockSize;}
-    static constexpr int getNumMemoryBlocks() {return maxAddress / blockSize;}
+    static constexpr uint32_t getMaxAddress() {return maxAddress;}
+
+    static constexpr int getMemoryBlockSize() {return pageSize;}
+    static constexpr int getNumMemoryBlocks() {return numPages;}
 
 private:
     struct IORange
     {
         uint16_t ioMask, ioValue;
-        uint8_t picMask;
         IODevice *dev;
     };
 
+    struct Event
+    {
+        uint32_t cycle;
+        IODevice *dev;
+        int id;
+    };
+
+    // for the min-heap, compared relative to each other to handle wrapping
+    static bool eventAfter(const Event &a, const Event &b) {return static_cast<int>(a.cycle - b.cycle) > 0;}
+
+    void updateNextEventCycle();
+
+    void updateIOPortMap();
+
+    IODevice *getIODevice(uint16_t addr) const {return ioPortMap[addr >> 8][addr & 0xFF];}
+
     // clocks
     static constexpr int systemClock = 14318180;
     static constexpr int cpuClkDiv = 3; // 4.7727MHz
@@ -285,21 +419,50 @@ private:
     uint32_t cycleCount = 0;
 #endif
 
-    uint32_t nextInterruptCycle = 0;
+    std::vector<Event> events; // heap, earliest first
+    uint32_t nextEventCycle = 0;
 
+    enum MemPageFlags
+    {
+        MemPage_HandlerMask = 0x3F, // index into memHandlers, 0 for none
+        MemPage_A20Wrap = 1 << 6, // HMA page with A20 disabled
+        MemPage_ReadOnly = 1 << 7,
+    };
+
+    void mapPages(uint32_t base, uint32_t size, uint8_t *ptr, uint8_t flags);
+
+#if defined(PICO_BUILD) || defined(ESP_BUILD)
     static const int maxAddress = 1 << 24;
-    static const int blockSize = 128 * 1024;
+#else
+    static const int maxAddress = 1 << 30;
+#endif
+    static const int pageSize = 4096;
+    static const int numPages = maxAddress / pageSize;
+
+    static const int maxMemHandlers = 16;
+
+    uint8_t *memMap[numPages] = {}; // offset by the page address so that memMap[addr >> 12][addr] works
+    uint8_t memPageFlags[numPages] = {};
 
-    uint8_t *memMap[maxAddress / blockSize];
+    uint8_t pageWatch[numPages] = {};
 
-    uint32_t memAccessCbBase, memAccessCbEnd;
-    MemReadCallback memReadCb = nullptr;
-    MemWriteCallback memWriteCb = nullptr;
-    void *memAccessUserData;
+    MemAccessHandler memHandlers[maxMemHandlers]; // [0] is unused
+
+    // the real mapping of the HMA while A20 is disabled
+    static const int hmaBase = 1 << 20;
+    static const int numHMAPages = 0x10000 / pageSize;
+
+    bool a20Enabled = true;
+    uint8_t *hmaMap[numHMAPages];
+    uint8_t hmaPageFlags[numHMAPages];
 
     Chipset chipset;
 
     std::vector<IORange> ioDevices;
 
+    // two-level port -> device map, pages with identical contents share a table
+    IODevice **ioPortMap[256];
+    std::vector<std::unique_ptr<IODevice *[]>> ioPortTables;
+
     CPU cpu;
 };
\ No newline at end of file
@@ -7,7 +7,7 @@
 VGACard::VGACard(System &sys) : sys(sys)
 {
     // FIXME: some could also be at 3Bx
-    sys.addIODevice(0x3E0, 0x3C0, 0, this); // 3Cx/3Dx
+    sys.addIODevice(0x3E0, 0x3C0, this); // 3Cx/3Dx
 }
 
 void RAM_FUNC(VGACard::drawScanline)(int line, uint8_t *output)
@@ -674,17 +674,20 @@ void VGACard::setupMemory()
         32 * 1024
     };
 
+    // make sure there isn't any memory (or an old mapping) there so our magic works
+    sys.removeMemory(0xA0000, 0x20000);
+
     if(!enabled)
-    {
         printf("VGA RAM disabled\n");
-        sys.setMemAccessCallbacks(0, 0, nullptr, nullptr);
-    }
     else
     {
         printf("VGA RAM at %05X (%iK) chain %i odd/even %i\n", mapAddrs[map], mapSizes[map] / 1024, chain, oddEven);
-        // make sure there isn't any memory mapped so our magic works
-        sys.addMemory(0xA0000, 0x20000, nullptr);
-        sys.setMemAccessCallbacks(mapAddrs[map], mapSizes[map], &VGACard::readMem, &VGACard::writeMem, this);
+
+        System::MemAccessHandler handler;
+        handler.read = &VGACard::readMem;
+        handler.write = &VGACard::writeMem;
+        handler.userData = this;
+        sys.setMemAccessHandler(mapAddrs[map], mapSizes[map], handler);
     }
 }
 
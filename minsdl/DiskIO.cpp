@@ -1,10 +1,89 @@
+#include <cstring>
 #include <filesystem>
 #include <iostream>
+#include <limits>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "Floppy.h"
 
 #include "DiskIO.h"
 
+// maps a whole file, private mappings can be written without affecting the file
+static uint8_t *mapFile(const std::string &path, bool writable, bool isPrivate, size_t &size)
+{
+#ifdef _WIN32
+    auto fileHandle = CreateFileA(path.c_str(), GENERIC_READ | (writable && !isPrivate ? GENERIC_WRITE : 0), FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                  nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if(fileHandle == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    LARGE_INTEGER fileSize;
+    if(!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0 || uint64_t(fileSize.QuadPart) > std::numeric_limits<size_t>::max())
+    {
+        CloseHandle(fileHandle);
+        return nullptr;
+    }
+
+    DWORD protect = !writable ? PAGE_READONLY : (isPrivate ? PAGE_WRITECOPY : PAGE_READWRITE);
+    auto mappingHandle = CreateFileMappingA(fileHandle, nullptr, protect, 0, 0, nullptr);
+    CloseHandle(fileHandle);
+
+    if(!mappingHandle)
+        return nullptr;
+
+    DWORD access = !writable ? FILE_MAP_READ : (isPrivate ? FILE_MAP_COPY : FILE_MAP_WRITE);
+    auto ptr = MapViewOfFile(mappingHandle, access, 0, 0, 0);
+    CloseHandle(mappingHandle); // the view keeps it open
+
+    if(!ptr)
+        return nullptr;
+
+    size = fileSize.QuadPart;
+#else
+    int fd = open(path.c_str(), writable && !isPrivate ? O_RDWR : O_RDONLY);
+
+    if(fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0 || uint64_t(st.st_size) > std::numeric_limits<size_t>::max())
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    auto ptr = mmap(nullptr, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0), isPrivate ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps it open
+
+    if(ptr == MAP_FAILED)
+        return nullptr;
+
+    size = st.st_size;
+#endif
+
+    return reinterpret_cast<uint8_t *>(ptr);
+}
+
+static void unmapFile(uint8_t *ptr, size_t size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(ptr);
+#else
+    munmap(ptr, size);
+#endif
+}
+
 bool FileFloppyIO::isPresent(int unit)
 {
     return unit < maxDrives && file[unit].is_open();
@@ -18,30 +97,12 @@ uint32_t FileFloppyIO::getLBA(int unit, uint8_t cylinder, uint8_t head, uint8_t
 
 bool FileFloppyIO::read(FloppyController *controller, int unit, uint8_t *buf, uint32_t lba)
 {
-    if(unit >= maxDrives)
-        return false;
-
-    file[unit].clear();
-
-    bool success = file[unit].seekg(lba * 512).read(reinterpret_cast<char *>(buf), 512).gcount() == 512;
-
-    controller->ioComplete(unit, success, false);
-
-    return success;
+    return startAccess(controller, unit, buf, lba, false);
 }
 
 bool FileFloppyIO::write(FloppyController *controller, int unit, const uint8_t *buf, uint32_t lba)
 {
-    if(unit >= maxDrives)
-        return false;
-
-    file[unit].clear();
-
-    bool success = file[unit].seekp(lba * 512).write(reinterpret_cast<const char *>(buf), 512).good();
-
-    controller->ioComplete(unit, success, true);
-
-    return success;
+    return startAccess(controller, unit, const_cast<uint8_t *>(buf), lba, true);
 }
 
 void FileFloppyIO::openDisk(int unit, std::string path)
@@ -72,6 +133,66 @@ void FileFloppyIO::openDisk(int unit, std::string path)
     }
 }
 
+bool FileFloppyIO::startAccess(FloppyController *controller, int unit, uint8_t *buf, uint32_t lba, bool write)
+{
+    if(unit >= maxDrives)
+        return false;
+
+    if(curAccessController)
+    {
+        std::cerr << "Floppy IO already in progress! (" << (curAccessWrite ? 'W' : 'R') << " " << curAccessLBA << " -> " << (write ? 'W' : 'R') << " " << lba << ")\n";
+        return false;
+    }
+
+    curAccessController = controller;
+    curAccessDevice = unit;
+    curAccessBuf = buf;
+    curAccessLBA = lba;
+    curAccessWrite = write;
+
+    if(ioThread)
+    {
+        ioThread->queue(this);
+        return true;
+    }
+
+    doIO();
+    bool success = curAccessSuccess;
+    ioComplete();
+
+    return success;
+}
+
+void FileFloppyIO::doIO()
+{
+    auto &f = file[curAccessDevice];
+
+    f.clear();
+
+    if(curAccessWrite)
+        curAccessSuccess = f.seekp(curAccessLBA * 512).write(reinterpret_cast<const char *>(curAccessBuf), 512).good();
+    else
+        curAccessSuccess = f.seekg(curAccessLBA * 512).read(reinterpret_cast<char *>(curAccessBuf), 512).gcount() == 512;
+}
+
+void FileFloppyIO::ioComplete()
+{
+    // the controller may start the next access
+    auto controller = curAccessController;
+    curAccessController = nullptr;
+
+    controller->ioComplete(curAccessDevice, curAccessSuccess, curAccessWrite);
+}
+
+FileATAIO::~FileATAIO()
+{
+    for(int i = 0; i < maxDrives; i++)
+    {
+        if(mapping[i])
+            unmapFile(mapping[i], mappingSize[i]);
+    }
+}
+
 uint32_t FileATAIO::getNumSectors(int drive)
 {
     if(drive >= maxDrives)
@@ -90,40 +211,34 @@ bool FileATAIO::isATAPI(int drive)
 
 bool FileATAIO::read(ATAController *controller, int drive, uint8_t *buf, uint32_t lba)
 {
-    if(drive >= maxDrives)
-        return false;
-
-    file[drive].clear();
-
-    int sectorSize = isCD[drive] ? 2048 : 512;
-    bool success = file[drive].seekg(lba * sectorSize).read(reinterpret_cast<char *>(buf), sectorSize).gcount() == sectorSize;
-
-    controller->ioComplete(drive, success, false);
-
-    return success;
+    return startAccess(controller, drive, buf, lba, false);
 }
 
 bool FileATAIO::write(ATAController *controller, int drive, const uint8_t *buf, uint32_t lba)
 {
-    if(drive >= maxDrives || isCD[drive])
-        return false;
+    return startAccess(controller, drive, const_cast<uint8_t *>(buf), lba, true);
+}
 
-    file[drive].clear();
+const uint8_t *FileATAIO::getSectorPtr(int drive, uint32_t lba)
+{
+    if(drive >= maxDrives || !mapping[drive] || lba >= numSectors[drive])
+        return nullptr;
 
-    bool success = file[drive].seekp(lba * 512).write(reinterpret_cast<const char *>(buf), 512).good();
+    int sectorSize = isCD[drive] ? 2048 : 512;
+    uint64_t offset = uint64_t(lba) * sectorSize;
 
-    controller->ioComplete(drive, success, true);
+    // modified sectors have to be read from the overlay
+    if(hasOverlay(drive) && overlay[drive].index[offset / overlayBlockSize])
+        return nullptr;
 
-    return success;
+    return mapping[drive] + offset;
 }
 
-void FileATAIO::openDisk(int drive, std::string path)
+void FileATAIO::openDisk(int drive, std::string path, MapMode mapMode, std::string overlayPath)
 {
     if(drive >= maxDrives)
         return;
 
-    file[drive].open(path, std::ios::in | std::ios::out | std::ios::binary);
-
     // assume .iso files are CDs
     isCD[drive] = false;
 
@@ -135,13 +250,415 @@ void FileATAIO::openDisk(int drive, std::string path)
         isCD[drive] = ext == "iso";
     }
 
-    // get size
     int sectorSize = isCD[drive] ? 2048 : 512;
 
-    file[drive].seekg(0, std::ios::end);
-    numSectors[drive] = file[drive].tellg() / sectorSize;
-    file[drive].seekg(0);
+    if(mapping[drive])
+    {
+        unmapFile(mapping[drive], mappingSize[drive]);
+        mapping[drive] = nullptr;
+    }
+
+    overlay[drive].file.close();
+
+    // CDs are never written
+    if(isCD[drive] && !overlayPath.empty())
+    {
+        std::cerr << "ignoring overlay for CD image " << path << "\n";
+        overlayPath.clear();
+    }
+
+    // the image is only read if there's an overlay
+    bool writable = !isCD[drive] && overlayPath.empty();
+    uint64_t imageSize = 0;
+
+    if(mapMode != MapMode::Off)
+    {
+        mapping[drive] = mapFile(path, writable, mapMode == MapMode::Private, mappingSize[drive]);
+        imageSize = mappingSize[drive];
+    }
+
+    if(!mapping[drive])
+    {
+        file[drive].open(path, writable ? std::ios::in | std::ios::out | std::ios::binary : std::ios::in | std::ios::binary);
+
+        // get size
+        file[drive].seekg(0, std::ios::end);
+        imageSize = file[drive] ? uint64_t(file[drive].tellg()) : 0;
+        file[drive].seekg(0);
+    }
+
+    numSectors[drive] = imageSize / sectorSize;
+
+    if(!mapping[drive] && !file[drive])
+        return;
+
+    if(!overlayPath.empty() && !openOverlay(drive, overlayPath, path, imageSize))
+    {
+        std::cerr << "failed to open overlay " << overlayPath << " for " << path << "\n";
+        numSectors[drive] = 0;
+        return;
+    }
 
-    if(file[drive])
-        std::cout << "Loaded ATA disk " << drive << ": " << path << " (size " << numSectors[drive] * sectorSize << ")\n";
-}
\ No newline at end of file
+    std::cout << "Loaded ATA disk " << drive << ": " << path << " (size " << numSectors[drive] * sectorSize;
+
+    if(mapping[drive])
+        std::cout << ", mapped" << (mapMode == MapMode::Private && writable ? ", writes discarded" : "");
+
+    if(!overlayPath.empty())
+        std::cout << ", overlay " << overlayPath << " with " << overlay[drive].numUsedBlocks << " modified blocks";
+
+    std::cout << ")\n";
+}
+
+bool FileATAIO::commitOverlay(int drive)
+{
+    if(!hasOverlay(drive))
+        return false;
+
+    auto &ovl = overlay[drive];
+
+    std::fstream image(ovl.imagePath, std::ios::in | std::ios::out | std::ios::binary);
+
+    if(!image)
+        return false;
+
+    std::vector<uint8_t> blockBuf(overlayBlockSize);
+
+    for(uint32_t block = 0; block < ovl.index.size(); block++)
+    {
+        if(!ovl.index[block])
+            continue;
+
+        uint64_t blockStart = uint64_t(block) * overlayBlockSize;
+        int len = std::min(uint64_t(overlayBlockSize), ovl.imageSize - blockStart);
+
+        if(!readOverlay(drive, blockBuf.data(), blockStart, len))
+            return false;
+
+        if(!image.seekp(blockStart).write(reinterpret_cast<const char *>(blockBuf.data()), len))
+            return false;
+    }
+
+    image.close();
+
+    if(image.fail())
+        return false;
+
+    return discardOverlay(drive);
+}
+
+bool FileATAIO::discardOverlay(int drive)
+{
+    if(!hasOverlay(drive))
+        return false;
+
+    auto &ovl = overlay[drive];
+
+    ovl.file.close();
+
+    std::fill(ovl.index.begin(), ovl.index.end(), 0);
+    ovl.numUsedBlocks = 0;
+
+    return createOverlay(drive);
+}
+
+bool FileATAIO::startAccess(ATAController *controller, int drive, uint8_t *buf, uint32_t lba, bool write)
+{
+    if(drive >= maxDrives || (write && isCD[drive]))
+        return false;
+
+    if(curAccessController)
+    {
+        std::cerr << "ATA IO already in progress! (" << (curAccessWrite ? 'W' : 'R') << " " << curAccessLBA << " -> " << (write ? 'W' : 'R') << " " << lba << ")\n";
+        return false;
+    }
+
+    curAccessController = controller;
+    curAccessDevice = drive;
+    curAccessBuf = buf;
+    curAccessLBA = lba;
+    curAccessWrite = write;
+
+    // no point using the thread for a copy
+    if(ioThread && (!mapping[drive] || hasOverlay(drive)))
+    {
+        ioThread->queue(this);
+        return true;
+    }
+
+    doIO();
+    bool success = curAccessSuccess;
+    ioComplete();
+
+    return success;
+}
+
+void FileATAIO::doIO()
+{
+    auto &f = file[curAccessDevice];
+
+    f.clear();
+
+    int sectorSize = isCD[curAccessDevice] ? 2048 : 512;
+
+    if(hasOverlay(curAccessDevice))
+    {
+        uint64_t offset = uint64_t(curAccessLBA) * sectorSize;
+
+        curAccessSuccess = curAccessLBA < numSectors[curAccessDevice];
+
+        if(!curAccessSuccess)
+            return;
+
+        if(curAccessWrite)
+            curAccessSuccess = writeOverlay(curAccessDevice, curAccessBuf, offset, sectorSize);
+        else
+            curAccessSuccess = readOverlay(curAccessDevice, curAccessBuf, offset, sectorSize);
+    }
+    else if(auto ptr = mapping[curAccessDevice])
+    {
+        curAccessSuccess = curAccessLBA < numSectors[curAccessDevice];
+
+        if(!curAccessSuccess)
+            return;
+
+        ptr += size_t(curAccessLBA) * sectorSize;
+
+        if(curAccessWrite)
+            memcpy(ptr, curAccessBuf, sectorSize);
+        else
+            memcpy(curAccessBuf, ptr, sectorSize);
+    }
+    else if(curAccessWrite)
+        curAccessSuccess = f.seekp(curAccessLBA * sectorSize).write(reinterpret_cast<const char *>(curAccessBuf), sectorSize).good();
+    else
+        curAccessSuccess = f.seekg(curAccessLBA * sectorSize).read(reinterpret_cast<char *>(curAccessBuf), sectorSize).gcount() == sectorSize;
+}
+
+void FileATAIO::ioComplete()
+{
+    auto controller = curAccessController;
+    curAccessController = nullptr;
+
+    controller->ioComplete(curAccessDevice, curAccessSuccess, curAccessWrite);
+}
+
+bool FileATAIO::readImage(int drive, uint8_t *buf, uint64_t offset, int len)
+{
+    if(mapping[drive])
+    {
+        memcpy(buf, mapping[drive] + offset, len);
+        return true;
+    }
+
+    auto &f = file[drive];
+    f.clear();
+
+    return f.seekg(offset).read(reinterpret_cast<char *>(buf), len).gcount() == len;
+}
+
+bool FileATAIO::openOverlay(int drive, const std::string &path, const std::string &imagePath, uint64_t imageSize)
+{
+    auto &ovl = overlay[drive];
+
+    ovl.path = path;
+    ovl.imagePath = imagePath;
+    ovl.imageSize = imageSize;
+    ovl.index.assign((imageSize + overlayBlockSize - 1) / overlayBlockSize, 0);
+    ovl.numUsedBlocks = 0;
+
+    ovl.file.open(path, std::ios::in | std::ios::out | std::ios::binary);
+
+    // new overlay
+    if(!ovl.file)
+        return createOverlay(drive);
+
+    OverlayHeader header;
+    if(!ovl.file.read(reinterpret_cast<char *>(&header), sizeof(header)))
+    {
+        ovl.file.close();
+        return false;
+    }
+
+    // make sure this is an overlay for something the same size
+    if(memcmp(header.magic, "PACECOW", 8) != 0 || header.version != 1 || header.blockSize != overlayBlockSize || header.imageSize != imageSize)
+    {
+        ovl.file.close();
+        return false;
+    }
+
+    ovl.file.seekg(overlayHeaderSize);
+    if(!ovl.file.read(reinterpret_cast<char *>(ovl.index.data()), ovl.index.size() * sizeof(uint32_t)))
+    {
+        ovl.file.close();
+        return false;
+    }
+
+    for(auto block : ovl.index)
+        ovl.numUsedBlocks = std::max(ovl.numUsedBlocks, block);
+
+    return true;
+}
+
+bool FileATAIO::createOverlay(int drive)
+{
+    auto &ovl = overlay[drive];
+
+    ovl.file.open(ovl.path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+
+    if(!ovl.file)
+        return false;
+
+    OverlayHeader header{};
+    memcpy(header.magic, "PACECOW", 8);
+    header.version = 1;
+    header.blockSize = overlayBlockSize;
+    header.imageSize = ovl.imageSize;
+
+    std::vector<char> headerBuf(overlayHeaderSize);
+    memcpy(headerBuf.data(), &header, sizeof(header));
+
+    ovl.file.write(headerBuf.data(), headerBuf.size());
+    ovl.file.write(reinterpret_cast<const char *>(ovl.index.data()), ovl.index.size() * sizeof(uint32_t));
+
+    if(!ovl.file.flush())
+    {
+        ovl.file.close();
+        return false;
+    }
+
+    return true;
+}
+
+bool FileATAIO::readOverlay(int drive, uint8_t *buf, uint64_t offset, int len)
+{
+    auto &ovl = overlay[drive];
+    auto block = ovl.index[offset / overlayBlockSize];
+
+    // unmodified
+    if(!block)
+        return readImage(drive, buf, offset, len);
+
+    ovl.file.clear();
+    ovl.file.seekg(getOverlayBlockOffset(drive, block) + offset % overlayBlockSize);
+
+    return ovl.file.read(reinterpret_cast<char *>(buf), len).gcount() == len;
+}
+
+bool FileATAIO::writeOverlay(int drive, const uint8_t *buf, uint64_t offset, int len)
+{
+    auto &ovl = overlay[drive];
+    auto blockIndex = offset / overlayBlockSize;
+    auto block = ovl.index[blockIndex];
+
+    ovl.file.clear();
+
+    // first write to this block, copy it from the image
+    if(!block)
+    {
+        std::vector<uint8_t> blockBuf(overlayBlockSize);
+
+        uint64_t blockStart = blockIndex * overlayBlockSize;
+        int blockLen = std::min(uint64_t(overlayBlockSize), ovl.imageSize - blockStart);
+
+        if(!readImage(drive, blockBuf.data(), blockStart, blockLen))
+            return false;
+
+        block = ovl.numUsedBlocks + 1;
+
+        if(!ovl.file.seekp(getOverlayBlockOffset(drive, block)).write(reinterpret_cast<const char *>(blockBuf.data()), overlayBlockSize))
+            return false;
+
+        // update the index after the data is there
+        if(!ovl.file.seekp(overlayHeaderSize + blockIndex * sizeof(uint32_t)).write(reinterpret_cast<const char *>(&block), sizeof(uint32_t)))
+            return false;
+
+        ovl.index[blockIndex] = block;
+        ovl.numUsedBlocks = block;
+    }
+
+    ovl.file.seekp(getOverlayBlockOffset(drive, block) + offset % overlayBlockSize);
+
+    return ovl.file.write(reinterpret_cast<const char *>(buf), len).good();
+}
+
+uint64_t FileATAIO::getOverlayBlockOffset(int drive, uint32_t block) const
+{
+    // data starts after the index
+    uint64_t indexEnd = overlayHeaderSize + overlay[drive].index.size() * sizeof(uint32_t);
+    uint64_t dataStart = (indexEnd + overlayBlockSize - 1) / overlayBlockSize * overlayBlockSize;
+
+    return dataStart + uint64_t(block - 1) * overlayBlockSize;
+}
+
+DiskIOThread::~DiskIOThread()
+{
+    if(!thread.joinable())
+        return;
+
+    {
+        std::lock_guard lock(mutex);
+        quit = true;
+    }
+
+    cond.notify_one();
+    thread.join();
+}
+
+void DiskIOThread::start(CompleteCallback cb)
+{
+    completeCallback = cb;
+    thread = std::thread(&DiskIOThread::threadFunc, this);
+}
+
+void DiskIOThread::queue(DiskIOJob *job)
+{
+    {
+        std::lock_guard lock(mutex);
+        pending.push_back(job);
+    }
+
+    cond.notify_one();
+}
+
+void DiskIOThread::update()
+{
+    std::unique_lock lock(mutex);
+
+    while(!complete.empty())
+    {
+        auto job = complete.front();
+        complete.pop_front();
+
+        // this may queue another access
+        lock.unlock();
+        job->ioComplete();
+        lock.lock();
+    }
+}
+
+void DiskIOThread::threadFunc()
+{
+    std::unique_lock lock(mutex);
+
+    while(true)
+    {
+        cond.wait(lock, [this]{return quit || !pending.empty();});
+
+        // finish anything queued first, so that writes aren't lost
+        if(pending.empty())
+            break;
+
+        auto job = pending.front();
+        pending.pop_front();
+
+        lock.unlock();
+        job->doIO();
+        lock.lock();
+
+        complete.push_back(job);
+
+        if(completeCallback)
+            completeCallback();
+    }
+}
@@ -1,11 +1,56 @@
 #pragma once
 
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "ATAController.h"
 #include "FloppyController.h"
 
-class FileFloppyIO final : public FloppyDiskIO
+// an access that can be run on the IO thread
+class DiskIOJob
+{
+public:
+    // on the IO thread
+    virtual void doIO() = 0;
+
+    // back on the CPU thread
+    virtual void ioComplete() = 0;
+};
+
+// runs disk accesses on a separate thread so that slow file access doesn't stall the CPU thread
+class DiskIOThread final
+{
+public:
+    // called from the IO thread when a job completes, so the CPU thread can be woken
+    using CompleteCallback = void(*)();
+
+    ~DiskIOThread();
+
+    void start(CompleteCallback cb);
+
+    void queue(DiskIOJob *job);
+
+    // calls ioComplete for any finished jobs, must be called from the CPU thread
+    void update();
+
+private:
+    void threadFunc();
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+
+    std::deque<DiskIOJob *> pending, complete;
+    bool quit = false;
+
+    CompleteCallback completeCallback = nullptr;
+};
+
+class FileFloppyIO final : public FloppyDiskIO, DiskIOJob
 {
 public:
     bool isPresent(int unit) override;
@@ -17,18 +62,46 @@ public:
 
     void openDisk(int unit, std::string path);
 
+    // accesses are synchronous without one
+    void setIOThread(DiskIOThread *thread) {ioThread = thread;}
+
     static const int maxDrives = 2;
 
 private:
+    bool startAccess(FloppyController *controller, int unit, uint8_t *buf, uint32_t lba, bool write);
+
+    void doIO() override;
+    void ioComplete() override;
+
     std::fstream file[maxDrives];
 
     bool doubleSided[maxDrives];
     int sectorsPerTrack[maxDrives];
+
+    DiskIOThread *ioThread = nullptr;
+
+    // saved params for current access
+    FloppyController *curAccessController = nullptr;
+    int curAccessDevice;
+    uint8_t *curAccessBuf;
+    uint32_t curAccessLBA;
+    bool curAccessWrite;
+    bool curAccessSuccess;
 };
 
-class FileATAIO final : public ATADiskIO
+class FileATAIO final : public ATADiskIO, DiskIOJob
 {
 public:
+    enum class MapMode
+    {
+        Off,     // read/write the file
+        Shared,  // memory map the image, writes go to the file
+        Private, // memory map the image, writes are only kept in memory
+    };
+
+    // unmaps the images, the controller (and IO thread) must have stopped using them by now
+    ~FileATAIO();
+
     uint32_t getNumSectors(int drive) override;
     
     virtual bool isATAPI(int drive) override;
@@ -36,13 +109,77 @@ public:
     bool read(ATAController *controller, int drive, uint8_t *buf, uint32_t lba) override;
     bool write(ATAController *controller, int drive, const uint8_t *buf, uint32_t lba) override;
 
-    void openDisk(int drive, std::string path);
+    const uint8_t *getSectorPtr(int drive, uint32_t lba) override;
+
+    // falls back to reading the file if mapping fails
+    // with an overlay path, the image is only read and writes go to the overlay (which is created if needed)
+    void openDisk(int drive, std::string path, MapMode mapMode = MapMode::Shared, std::string overlayPath = {});
+
+    bool hasOverlay(int drive) const {return drive < maxDrives && overlay[drive].file.is_open();}
+
+    // writes the changes in the overlay to the image, then empties it
+    bool commitOverlay(int drive);
+    // throws away the changes in the overlay
+    bool discardOverlay(int drive);
+
+    // accesses are synchronous without one
+    void setIOThread(DiskIOThread *thread) {ioThread = thread;}
 
     static const int maxDrives = 2;
 
 private:
+    // copy-on-write overlay file:
+    // header, index of overlay block + 1 (0 if unmodified) for each block of the image, blocks aligned to the block size
+    struct OverlayHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t blockSize;
+        uint64_t imageSize;
+    };
+
+    struct Overlay
+    {
+        std::fstream file;
+        std::string path, imagePath;
+        uint64_t imageSize = 0;
+        std::vector<uint32_t> index;
+        uint32_t numUsedBlocks = 0;
+    };
+
+    static const int overlayBlockSize = 64 * 1024;
+    static const int overlayHeaderSize = 512;
+
+    bool startAccess(ATAController *controller, int drive, uint8_t *buf, uint32_t lba, bool write);
+
+    void doIO() override;
+    void ioComplete() override;
+
+    bool readImage(int drive, uint8_t *buf, uint64_t offset, int len);
+
+    bool openOverlay(int drive, const std::string &path, const std::string &imagePath, uint64_t imageSize);
+    bool createOverlay(int drive);
+    bool readOverlay(int drive, uint8_t *buf, uint64_t offset, int len);
+    bool writeOverlay(int drive, const uint8_t *buf, uint64_t offset, int len);
+    uint64_t getOverlayBlockOffset(int drive, uint32_t block) const;
+
     std::fstream file[maxDrives];
 
+    Overlay overlay[maxDrives];
+
+    uint8_t *mapping[maxDrives]{};
+    size_t mappingSize[maxDrives]{};
+
     uint32_t numSectors[maxDrives]{};
     bool isCD[maxDrives]{};
+
+    DiskIOThread *ioThread = nullptr;
+
+    // saved params for current access
+    ATAController *curAccessController = nullptr;
+    int curAccessDevice;
+    uint8_t *curAccessBuf;
+    uint32_t curAccessLBA;
+    bool curAccessWrite;
+    bool curAccessSuccess;
 };
\ No newline at end of file
@@ -1,7 +1,18 @@
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 #include <SDL3/SDL.h>
 
@@ -15,7 +26,7 @@
 
 #include "DiskIO.h"
 
-static bool quit = false;
+static std::atomic<bool> quit{false};
 
 static SDL_AudioStream *audioStream;
 
@@ -27,13 +38,32 @@ static GamePort gamePort(sys);
 static QEMUConfig qemuCfg(sys);
 static VGACard vgaCard(sys);
 
-static uint8_t ram[8 * 1024 * 1024];
+static uint8_t *ram = nullptr;
+static uint32_t ramSize = 8 * 1024 * 1024;
+
+// 0 = real time, otherwise time only advances with emulated instructions
+// and runs at (up to) N times real time, or as fast as possible
+static constexpr int speedRealTime = 0;
+static constexpr int speedUnlimited = -1;
+static std::atomic<int> emuSpeed{speedRealTime};
+
+// for waking the CPU thread when halted
+static SDL_Semaphore *cpuWakeSem = nullptr;
+static std::atomic<Uint64> cpuWakeTime{0};
+
+// set by the event thread, the stats are printed (and reset) by the CPU thread
+static std::atomic<bool> printStatsRequested{false};
+
+// halt stats
+static uint64_t haltWakeups = 0, haltSleepNS = 0;
+static uint64_t haltTotalLatencyNS = 0, haltMaxLatencyNS = 0;
 
 static uint8_t biosROM[0x20000];
 static uint8_t vgaBIOS[0x10000];
 
 static FileFloppyIO floppyIO;
 static FileATAIO ataPrimaryIO;
+static DiskIOThread diskIOThread; // after the IO objects so it's stopped first
 
 static std::list<std::string> nextFloppyImage;
 
@@ -324,18 +354,134 @@ static Uint64 systemTimerCallback(void *userdata, SDL_TimerID timerID, Uint64 in
     auto elapsed = (now - lastUpdate) / interval;
     lastUpdate += elapsed * interval;
 
+    // the CPU is advancing time
+    if(emuSpeed != speedRealTime)
+        return interval;
+
     // this expects the old cpu clock (~4.77MHz), we're going for the PIT clock (~1.19MHz)
     reinterpret_cast<System *>(userdata)->addCPUCycles(elapsed * 4);
     return interval;
 }
 
+#ifdef _WIN32
+// guest RAM is only reserved, commit it in blocks as it's touched
+static LONG CALLBACK ramExceptionHandler(EXCEPTION_POINTERS *info)
+{
+    const uintptr_t commitBlockSize = 64 * 1024;
+
+    auto record = info->ExceptionRecord;
+    if(record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2)
+        return EXCEPTION_CONTINUE_SEARCH;
+
+    auto addr = reinterpret_cast<uint8_t *>(record->ExceptionInformation[1]);
+    if(!ram || addr < ram || addr >= ram + ramSize)
+        return EXCEPTION_CONTINUE_SEARCH;
+
+    auto block = reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(addr) & ~(commitBlockSize - 1));
+    if(!VirtualAlloc(block, commitBlockSize, MEM_COMMIT, PAGE_READWRITE))
+        return EXCEPTION_CONTINUE_SEARCH;
+
+    return EXCEPTION_CONTINUE_EXECUTION;
+}
+#endif
+
+// reserves address space for guest RAM, pages are only committed when they're touched
+static uint8_t *allocateRAM(uint32_t size)
+{
+#ifdef _WIN32
+    auto ptr = VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+
+    if(ptr)
+        AddVectoredExceptionHandler(1, ramExceptionHandler);
+
+    return reinterpret_cast<uint8_t *>(ptr);
+#else
+    auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return ptr == MAP_FAILED ? nullptr : reinterpret_cast<uint8_t *>(ptr);
+#endif
+}
+
+// how much of guest RAM is actually backed by host memory, or -1 if we can't tell
+static int64_t getCommittedRAM()
+{
+#ifdef _WIN32
+    int64_t committed = 0;
+    MEMORY_BASIC_INFORMATION info;
+
+    for(auto ptr = ram; ptr < ram + ramSize;)
+    {
+        if(!VirtualQuery(ptr, &info, sizeof(info)))
+            return -1;
+
+        auto end = std::min(reinterpret_cast<uint8_t *>(info.BaseAddress) + info.RegionSize, ram + ramSize);
+
+        if(info.State == MEM_COMMIT)
+            committed += end - ptr;
+
+        ptr = end;
+    }
+
+    return committed;
+#else
+    auto hostPageSize = sysconf(_SC_PAGESIZE);
+    auto numHostPages = (ramSize + hostPageSize - 1) / hostPageSize;
+
+#ifdef __APPLE__
+    std::vector<char> residency(numHostPages);
+#else
+    std::vector<unsigned char> residency(numHostPages);
+#endif
+
+    if(mincore(ram, ramSize, residency.data()) != 0)
+        return -1;
+
+    int64_t committed = 0;
+    for(auto page : residency)
+    {
+        if(page & 1)
+            committed += hostPageSize;
+    }
+
+    return committed;
+#endif
+}
+
+// on the CPU thread, as it resets the counters
+static void printStats()
+{
+    auto &cpu = sys.getCPU();
+
+    auto &walkStats = cpu.getPageWalkStats();
+    std::cout << "Page walks: " << walkStats.walks << " (" << walkStats.dirCacheHits << " dir cache hits, "
+              << walkStats.tableReads << " reads, " << walkStats.tableWrites << " writes), "
+              << walkStats.flushes << " TLB flushes\n";
+    cpu.resetPageWalkStats();
+
+    std::cout << "Executed cycles: " << cpu.getExecutedCycles() << "\n";
+
+    if(haltWakeups)
+    {
+        std::cout << "Halted: " << haltSleepNS / 1000000 << "ms sleeping, " << haltWakeups << " wakeups (latency avg "
+                  << haltTotalLatencyNS / haltWakeups / 1000 << "us, max " << haltMaxLatencyNS / 1000 << "us)\n";
+    }
+    haltWakeups = haltSleepNS = haltTotalLatencyNS = haltMaxLatencyNS = 0;
+
+    auto committed = getCommittedRAM();
+    if(committed >= 0)
+        std::cout << "Guest RAM: " << committed / 1024 << "K of " << ramSize / 1024 << "K committed\n";
+}
+
 static void pollEvents()
 {
     const int escMod = SDL_KMOD_RCTRL | SDL_KMOD_RSHIFT;
 
+    bool hadEvents = false;
+
     SDL_Event event;
     while(SDL_PollEvent(&event))
     {
+        hadEvents = true;
+
         switch(event.type)
         {
             case SDL_EVENT_KEY_DOWN:
@@ -369,6 +515,32 @@ static void pollEvents()
                             }
                             break;
                         }
+
+                        case SDLK_S:
+                            printStatsRequested = true;
+                            break;
+
+                        case SDLK_T:
+                        {
+                            // cycle real time -> 1x -> 2x -> unlimited
+                            int speed = emuSpeed;
+                            if(speed == speedUnlimited)
+                                speed = speedRealTime;
+                            else if(speed == 2)
+                                speed = speedUnlimited;
+                            else
+                                speed++;
+
+                            emuSpeed = speed;
+
+                            if(speed == speedRealTime)
+                                std::cout << "Speed: real time\n";
+                            else if(speed == speedUnlimited)
+                                std::cout << "Speed: unlimited\n";
+                            else
+                                std::cout << "Speed: " << speed << "x\n";
+                            break;
+                        }
                     }
                 }
                 else
@@ -414,6 +586,56 @@ static void pollEvents()
     }
 
     sys.getChipset().syncMouse();
+
+    // input may have raised an interrupt
+    if(hadEvents)
+    {
+        cpuWakeTime = SDL_GetTicksNS();
+        SDL_SignalSemaphore(cpuWakeSem);
+    }
+}
+
+// sleeps until the next device deadline or some input
+static void waitForInterrupt()
+{
+    // the timer callback keeps time moving while we wait
+    const int maxWaitCycles = System::getClockSpeed() / 100;
+
+    int toNext = std::min(int(sys.getNextEventCycle() - sys.getCycleCount()), maxWaitCycles);
+    auto waitNS = uint64_t(std::max(toNext, 0)) * 1000000000 / System::getClockSpeed();
+
+    // not worth sleeping, or something happened while the CPU was running
+    if(waitNS < 1000000 || SDL_GetSemaphoreValue(cpuWakeSem))
+        return;
+
+    auto start = SDL_GetTicksNS();
+    bool woken = SDL_WaitSemaphoreTimeout(cpuWakeSem, waitNS / 1000000);
+    auto end = SDL_GetTicksNS();
+
+    // measure how late we woke up, either after the deadline or the event
+    auto wakeTarget = woken ? Uint64(cpuWakeTime) : start + waitNS;
+    auto latency = end > wakeTarget ? end - wakeTarget : 0;
+
+    haltWakeups++;
+    haltSleepNS += end - start;
+    haltTotalLatencyNS += latency;
+    haltMaxLatencyNS = std::max(haltMaxLatencyNS, latency);
+}
+
+// disk accesses only go to the IO thread in real time
+// with virtual time the CPU would keep skipping ahead while waiting for one
+static void updateDiskIOMode(int speed)
+{
+    auto ioThread = speed == speedRealTime ? &diskIOThread : nullptr;
+    floppyIO.setIOThread(ioThread);
+    ataPrimaryIO.setIOThread(ioThread);
+}
+
+static void diskIOCompleteCallback()
+{
+    // may be waiting for the disk
+    cpuWakeTime = SDL_GetTicksNS();
+    SDL_SignalSemaphore(cpuWakeSem);
 }
 
 static int cpuThreadFunc(void *data)
@@ -423,13 +645,93 @@ static int cpuThreadFunc(void *data)
     // FIXME: probably should lock around doing inputs
 
     auto lastTime = time(nullptr);
+    auto lastRTCCycle = sys.getCycleCount();
+
+    int curSpeed = speedRealTime;
+
+    // for throttling virtual time
+    auto lastCycleCount = sys.getCycleCount();
+    uint64_t virtualCycles = 0;
+    Uint64 virtualStartTime = 0;
 
     while(!quit)
     {
+        // switch timing mode
+        int speed = emuSpeed;
+        if(speed != curSpeed)
+        {
+            cpu.setTimingMode(speed == speedRealTime ? CPU::TimingMode::RealTime : CPU::TimingMode::Deterministic);
+
+            // restart from the current time in either direction, so nothing jumps
+            if(curSpeed == speedRealTime)
+                lastRTCCycle = sys.getCycleCount();
+            else
+                lastTime = time(nullptr);
+
+            virtualCycles = 0;
+            virtualStartTime = SDL_GetTicksNS();
+            curSpeed = speed;
+
+            updateDiskIOMode(speed);
+        }
+
+        // anything that signalled before now gets handled by this run, don't wake up for it later
+        while(SDL_TryWaitSemaphore(cpuWakeSem)) {}
+
+        diskIOThread.update();
+
+        if(printStatsRequested.exchange(false))
+            printStats();
+
         cpu.run(1);
 
         sys.getChipset().updateForDisplay(); // this just tries to make sure the PIT doesn't get too far behind
 
+        if(curSpeed != speedRealTime)
+        {
+            // update RTC from emulated seconds
+            while(sys.getCycleCount() - lastRTCCycle >= uint32_t(System::getClockSpeed()))
+            {
+                lastRTCCycle += System::getClockSpeed();
+                sys.getChipset().updateRTC();
+            }
+
+            auto cycleCount = sys.getCycleCount();
+            virtualCycles += cycleCount - lastCycleCount;
+            lastCycleCount = cycleCount;
+
+            if(curSpeed == speedUnlimited)
+                continue;
+
+            // move the start forward every (target) second so that this can't overflow
+            auto cyclesPerSecond = uint64_t(System::getClockSpeed()) * curSpeed;
+            while(virtualCycles >= cyclesPerSecond)
+            {
+                virtualCycles -= cyclesPerSecond;
+                virtualStartTime += 1000000000;
+            }
+
+            // wait if we're ahead of the host
+            // (the start may be slightly in the future after moving it)
+            auto targetNS = int64_t(virtualCycles * 1000000000 / cyclesPerSecond);
+            auto elapsedNS = int64_t(SDL_GetTicksNS() - virtualStartTime);
+
+            if(targetNS > elapsedNS + 1000000)
+                SDL_DelayNS(targetNS - elapsedNS);
+            else if(elapsedNS > targetNS + 100000000)
+            {
+                // too far behind, give up on catching up
+                virtualCycles = 0;
+                virtualStartTime = SDL_GetTicksNS();
+            }
+            continue;
+        }
+
+        lastCycleCount = sys.getCycleCount();
+
+        if(cpu.isIdle())
+            waitForInterrupt();
+
         // update RTC
         auto newTime = time(nullptr);
         if(newTime != lastTime)
@@ -441,10 +743,28 @@ static int cpuThreadFunc(void *data)
     return 0;
 }
 
-static void speakerCallback(int8_t sample)
+static void speakerCallback(const int8_t *samples, int count)
 {
-    int16_t sample16 = sample << 4;
-    SDL_PutAudioStreamData(audioStream, &sample16, sizeof(sample16));
+    // drop audio if we're running faster than real time instead of building up latency
+    const int maxQueued = 44100 / 10 * sizeof(int16_t);
+
+    if(SDL_GetAudioStreamQueued(audioStream) > maxQueued)
+        return;
+
+    int16_t samples16[256];
+
+    while(count)
+    {
+        int chunk = std::min(count, int(std::size(samples16)));
+
+        for(int i = 0; i < chunk; i++)
+            samples16[i] = samples[i] << 4;
+
+        SDL_PutAudioStreamData(audioStream, samples16, chunk * sizeof(int16_t));
+
+        samples += chunk;
+        count -= chunk;
+    }
 }
 
 int main(int argc, char *argv[])
@@ -460,6 +780,18 @@ int main(int argc, char *argv[])
     std::string biosPath = "bios.bin";
     std::string floppyPaths[FileFloppyIO::maxDrives];
     std::string ataPaths[FileATAIO::maxDrives];
+    std::string ataOverlayPaths[FileATAIO::maxDrives];
+    FileATAIO::MapMode ataMapModes[FileATAIO::maxDrives];
+    std::fill(std::begin(ataMapModes), std::end(ataMapModes), FileATAIO::MapMode::Shared);
+
+    int cpuMHz = 0;
+    int speed = speedRealTime;
+    bool deterministic = false; // virtual time starting from a fixed date
+    bool commitOverlays = false, discardOverlays = false;
+
+#ifdef PACE_JIT
+    bool jitEnabled = false, jitVerify = false;
+#endif
 
     int i = 1;
 
@@ -494,6 +826,58 @@ int main(int argc, char *argv[])
             if(n >= 0 && n < FileATAIO::maxDrives)
                 ataPrimary.overrideSectorsPerTrack(n, std::stoi(argv[++i]));
         }
+        else if(arg.compare(0, 13, "--ata-overlay") == 0 && arg.length() == 14 && i + 1 < argc)
+        {
+            int n = arg[13] - '0';
+            if(n >= 0 && n < FileATAIO::maxDrives)
+                ataOverlayPaths[n] = argv[++i];
+        }
+        else if(arg == "--ata-overlay-commit")
+            commitOverlays = true;
+        else if(arg == "--ata-overlay-discard")
+            discardOverlays = true;
+        else if(arg.compare(0, 10, "--ata-mmap") == 0 && arg.length() == 11 && i + 1 < argc)
+        {
+            int n = arg[10] - '0';
+            std::string mode = argv[++i];
+
+            FileATAIO::MapMode mapMode;
+            if(mode == "off")
+                mapMode = FileATAIO::MapMode::Off;
+            else if(mode == "shared")
+                mapMode = FileATAIO::MapMode::Shared;
+            else if(mode == "private")
+                mapMode = FileATAIO::MapMode::Private;
+            else
+            {
+                std::cerr << "Unknown ATA mapping mode \"" << mode << "\" (expected off, shared or private)\n";
+                return 1;
+            }
+
+            if(n >= 0 && n < FileATAIO::maxDrives)
+                ataMapModes[n] = mapMode;
+        }
+        else if(arg == "--mem" && i + 1 < argc)
+            ramSize = std::min(std::stoul(argv[++i]), 4095ul) * 1024 * 1024;
+        else if(arg == "--deterministic")
+        {
+            deterministic = true;
+            if(speed == speedRealTime)
+                speed = speedUnlimited;
+        }
+        else if(arg == "--speed" && i + 1 < argc)
+        {
+            std::string val(argv[++i]);
+            speed = val == "max" ? speedUnlimited : std::max(std::stoi(val), 1);
+        }
+        else if(arg == "--cpu-mhz" && i + 1 < argc)
+            cpuMHz = std::stoi(argv[++i]);
+#ifdef PACE_JIT
+        else if(arg == "--jit")
+            jitEnabled = true;
+        else if(arg == "--jit-verify")
+            jitEnabled = jitVerify = true;
+#endif
         else
             break;
     }
@@ -506,7 +890,27 @@ int main(int argc, char *argv[])
   
     // emu init
     auto &cpu = sys.getCPU();
-    sys.addMemory(0, sizeof(ram), ram);
+    if(ramSize < 1024 * 1024 || ramSize > System::getMaxAddress())
+    {
+        std::cerr << "Memory size must be between 1 and " << System::getMaxAddress() / (1024 * 1024) << "MB\n";
+        return 1;
+    }
+
+    ram = allocateRAM(ramSize);
+
+    if(!ram)
+    {
+        std::cerr << "Failed to allocate " << ramSize / (1024 * 1024) << "MB of guest RAM\n";
+        return 1;
+    }
+
+    sys.addMemory(0, ramSize, ram);
+    sys.getChipset().setTotalMemory(ramSize);
+
+#ifdef PACE_JIT
+    cpu.setJITEnabled(jitEnabled);
+    cpu.setJITVerify(jitVerify);
+#endif
 
     sys.getChipset().setSpeakerAudioCallback(speakerCallback);
 
@@ -523,7 +927,8 @@ int main(int argc, char *argv[])
         if(readLen < sizeof(biosROM))
             biosBase += sizeof(biosROM) - readLen;
 
-        sys.addReadOnlyMemory(biosBase, readLen, biosROM);
+        // SeaBIOS expects to be able to write to its own segment (shadow RAM), so this can't be read-only
+        sys.addMemory(biosBase, readLen, biosROM);
         biosFile.close();
     }
     else
@@ -565,18 +970,48 @@ int main(int argc, char *argv[])
     {
         if(!ataPaths[i].empty())
         {
-            ataPrimaryIO.openDisk(i, basePath + ataPaths[i]);
+            auto overlayPath = ataOverlayPaths[i].empty() ? "" : basePath + ataOverlayPaths[i];
+            ataPrimaryIO.openDisk(i, basePath + ataPaths[i], ataMapModes[i], overlayPath);
             sys.getChipset().setFixedDiskPresent(i, ataPrimaryIO.getNumSectors(i) && !ataPrimaryIO.isATAPI(i));
+
+            if(!ataPrimaryIO.hasOverlay(i))
+                continue;
+
+            if(commitOverlays)
+            {
+                if(ataPrimaryIO.commitOverlay(i))
+                    std::cout << "Committed overlay for ATA disk " << i << "\n";
+                else
+                    std::cerr << "Failed to commit overlay for ATA disk " << i << "\n";
+            }
+            else if(discardOverlays)
+            {
+                if(!ataPrimaryIO.discardOverlay(i))
+                    std::cerr << "Failed to discard overlay for ATA disk " << i << "\n";
+            }
         }
     }
+
+    // only wanted to update the images
+    if(commitOverlays)
+        return 0;
     
     fdc.setIOInterface(&floppyIO);
     ataPrimary.setIOInterface(&ataPrimaryIO);
 
+    // do disk accesses in the background (if running in real time)
+    diskIOThread.start(diskIOCompleteCallback);
+    updateDiskIOMode(speed);
+
     sys.reset();
 
-    // set the clock
-    auto t = time(nullptr);
+    if(cpuMHz > 0)
+        cpu.setClockSpeed(cpuMHz * 1000000);
+
+    emuSpeed = speed;
+
+    // set the clock (to a fixed date if we want the same result every time)
+    auto t = deterministic ? time_t(946684800) /*2000-01-01*/ : time(nullptr);
     auto tmbuf = gmtime(&t);
     sys.getChipset().setRTC(tmbuf->tm_sec, tmbuf->tm_min, tmbuf->tm_hour, tmbuf->tm_mday, tmbuf->tm_mon + 1, tmbuf->tm_year + 1900);
 
@@ -626,6 +1061,8 @@ int main(int argc, char *argv[])
     // timer
     SDL_AddTimerNS(838, systemTimerCallback, &sys); // ~1.193MHz
 
+    cpuWakeSem = SDL_CreateSemaphore(0);
+
     auto cpuThread = SDL_CreateThread(cpuThreadFunc, "CPU", nullptr);
 
     while(!quit)
@@ -648,6 +1085,11 @@ int main(int argc, char *argv[])
         SDL_RenderPresent(renderer);
     }
 
+    // stop the CPU before anything it uses goes away
+    // (the disk IO thread then finishes any queued accesses when it's destroyed,
+    // and the ATA images are unmapped after that, while nothing can be reading through readBuf)
+    SDL_WaitThread(cpuThread, nullptr);
+
     SDL_DestroyAudioStream(audioStream);
 
     SDL_DestroyTexture(texture);
@@ -76,10 +76,10 @@ static void initWifi(const char *ssid, const char *pass);
 
 static void ntpRequest(const char *addr);
 
-static void speakerCallback(int8_t sample)
+static void speakerCallback(const int8_t *samples, int count)
 {
-    int16_t sample16 = sample << 4;
-    audio_queue_sample(sample16);
+    for(int i = 0; i < count; i++)
+        audio_queue_sample(samples[i] << 4);
 }
 
 void update_key_state(ATScancode code, bool state)